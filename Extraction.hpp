@@ -0,0 +1,376 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <functional>
+#include <iostream>
+#include <fstream>
+#include <cmath>
+#include <string>
+#include <utility>
+#include <cstdint>
+#include <algorithm>
+#include "TriTable.hpp"
+#include "Profiler.hpp"
+
+glm::vec3 vertexInterp(float isovalue, const glm::vec3 &p1, const glm::vec3 &p2, float valp1, float valp2)
+{
+    if (fabs(isovalue - valp1) < 0.00001f)
+        return p1;
+    if (fabs(isovalue - valp2) < 0.00001f)
+        return p2;
+    if (fabs(valp1 - valp2) < 0.00001f)
+        return p1;
+    float mu = (isovalue - valp1) / (valp2 - valp1);
+    return p1 + mu * (p2 - p1);
+}
+
+int edgeIndex[12][2] = {
+    {0, 1}, {1, 2}, {2, 3}, {3, 0}, {4, 5}, {5, 6}, {6, 7}, {7, 4}, {0, 4}, {1, 5}, {2, 6}, {3, 7}};
+
+int cornerOffset[8][3] = {
+    {0, 0, 0}, {1, 0, 0}, {1, 0, 1}, {0, 0, 1}, {0, 1, 0}, {1, 1, 0}, {1, 1, 1}, {0, 1, 1}};
+
+// A cell the surface crosses, with the corner samples taken by the counting
+// pass so the emitting pass does not evaluate the field again.
+struct ActiveCell
+{
+    uint32_t i, j, k;
+    int cubeIndex;
+    float values[8];
+};
+
+// Buffers reused across extractions. They are resized to the exact output
+// size but never shrunk, so once a context has seen a surface of a given size
+// re-extracting it does not touch the heap. A context is not shared between
+// threads; give every worker its own.
+struct ExtractionContext
+{
+    std::vector<float> vertices;
+    std::vector<float> normals;
+    std::vector<float> interleaved;
+    // Scratch: the lattice coordinates along one axis, two x slabs of field
+    // samples and the cells the surface crosses.
+    std::vector<float> coords;
+    std::vector<float> slabs;
+    std::vector<ActiveCell> activeCells;
+    // Number of times a buffer had to grow, and the bytes reserved by those
+    // growths.
+    size_t allocations = 0;
+    size_t allocatedBytes = 0;
+};
+
+// Cells per axis, counted the way the extraction steps through the grid:
+// corners at gridMin, gridMin + stepSize, ... accumulated while below gridMax.
+// Every path that sizes a lattice uses this so they cover the same domain.
+int latticeCellCount(float gridMin, float gridMax, float stepSize)
+{
+    int cells = 0;
+    for (float c = gridMin; c < gridMax; c += stepSize)
+        cells++;
+    return cells;
+}
+
+// Step size that gives exactly numCells cells between gridMin and gridMax as
+// counted by latticeCellCount. (gridMax - gridMin) / numCells can accumulate
+// to just below gridMax and add a cell past the box, so the step is nudged
+// by a few ulps until the count matches.
+float latticeStepSize(float gridMin, float gridMax, int numCells)
+{
+    float step = (gridMax - gridMin) / numCells;
+    for (int tries = 0; tries < 1024; tries++)
+    {
+        int cells = latticeCellCount(gridMin, gridMax, step);
+        if (cells == numCells)
+            break;
+        step = std::nextafter(step, cells > numCells ? gridMax - gridMin : 0.0f);
+    }
+    return step;
+}
+
+template <typename T>
+void reserveTracked(ExtractionContext &ctx, std::vector<T> &buffer, size_t count)
+{
+    if (buffer.capacity() >= count)
+        return;
+    buffer.reserve(count);
+    ctx.allocations++;
+    ctx.allocatedBytes += buffer.capacity() * sizeof(T);
+}
+
+// Triangles emitted by each of the 256 cube cases.
+const unsigned char *caseTriangleCounts()
+{
+    static unsigned char counts[256];
+    static bool built = []()
+    {
+        for (int c = 0; c < 256; c++)
+        {
+            int n = 0;
+            while (n < 16 && marching_cubes_lut[c][n] != -1)
+                n++;
+            counts[c] = (unsigned char)(n / 3);
+        }
+        return true;
+    }();
+    (void)built;
+    return counts;
+}
+
+void sampleSlab(const std::function<float(float, float, float)> &f, const std::vector<float> &coords, size_t i, float *slab)
+{
+    MC_PROFILE_SECTION(StageFieldEvaluation);
+    size_t points = coords.size();
+    for (size_t j = 0; j < points; j++)
+    {
+        for (size_t k = 0; k < points; k++)
+            slab[j * points + k] = f(coords[i], coords[j], coords[k]);
+    }
+}
+
+// Extracts the triangle soup into ctx.vertices from the cells between the
+// corner coordinates in ctx.coords, which are the same along every axis.
+// slab(i) returns the points x points samples at x index i, laid out as
+// [j * points + k]; the slabs for i and i + 1 must be valid together.
+//
+// A counting pass sweeps the lattice one x slab at a time and records the
+// cells the surface crosses along with their corner values; the output is
+// then sized exactly and only those cells are revisited to emit triangles.
+template <typename Slab>
+void marchSlabs(ExtractionContext &ctx, float isovalue, Slab slab)
+{
+    ctx.vertices.clear();
+    ctx.activeCells.clear();
+    if (ctx.coords.size() < 2)
+        return;
+    const std::vector<float> &coords = ctx.coords;
+    size_t cells = coords.size() - 1;
+    size_t points = coords.size();
+
+    const unsigned char *triangleCounts = caseTriangleCounts();
+    size_t triangles = 0;
+    const float *lower = slab(0);
+    for (size_t i = 0; i < cells; i++)
+    {
+        const float *upper = slab(i + 1);
+        MC_PROFILE_SECTION(StageCaseClassification);
+        for (size_t j = 0; j < cells; j++)
+        {
+            for (size_t k = 0; k < cells; k++)
+            {
+                float cubeValues[8];
+                int cubeIndex = 0;
+                for (int c = 0; c < 8; c++)
+                {
+                    const float *values = cornerOffset[c][0] ? upper : lower;
+                    cubeValues[c] = values[(j + cornerOffset[c][1]) * points + k + cornerOffset[c][2]];
+                    if (cubeValues[c] < isovalue)
+                        cubeIndex |= (1 << c);
+                }
+                if (triangleCounts[cubeIndex] == 0)
+                    continue;
+                triangles += triangleCounts[cubeIndex];
+                if (ctx.activeCells.size() == ctx.activeCells.capacity())
+                    reserveTracked(ctx, ctx.activeCells, 2 * ctx.activeCells.size() + 1024);
+                ActiveCell cell = {(uint32_t)i, (uint32_t)j, (uint32_t)k, cubeIndex, {}};
+                std::copy(cubeValues, cubeValues + 8, cell.values);
+                ctx.activeCells.push_back(cell);
+            }
+        }
+        lower = upper;
+    }
+
+    reserveTracked(ctx, ctx.vertices, triangles * 9);
+    ctx.vertices.resize(triangles * 9);
+    float *out = ctx.vertices.data();
+    MC_PROFILE_SECTION(StageVertexInterpolation);
+    for (const ActiveCell &cell : ctx.activeCells)
+    {
+        glm::vec3 cubeVerts[8];
+        for (int c = 0; c < 8; c++)
+            cubeVerts[c] = glm::vec3(coords[cell.i + cornerOffset[c][0]], coords[cell.j + cornerOffset[c][1]], coords[cell.k + cornerOffset[c][2]]);
+        for (int t = 0; marching_cubes_lut[cell.cubeIndex][t] != -1; t++)
+        {
+            int edge = marching_cubes_lut[cell.cubeIndex][t];
+            int v1 = edgeIndex[edge][0];
+            int v2 = edgeIndex[edge][1];
+            glm::vec3 p = vertexInterp(isovalue, cubeVerts[v1], cubeVerts[v2], cell.values[v1], cell.values[v2]);
+            *out++ = p.x;
+            *out++ = p.y;
+            *out++ = p.z;
+        }
+    }
+    MC_COUNT(CounterCellsVisited, cells * cells * cells);
+    MC_COUNT(CounterActiveCells, ctx.activeCells.size());
+    MC_COUNT(CounterTriangles, triangles);
+}
+
+// Samples f on the grid and extracts the surface, evaluating every corner
+// once. Lattice coordinates are accumulated as gridMin + stepSize + ... so
+// the cells and vertices match the original x += stepSize loop bit for bit.
+void marchingCubes(ExtractionContext &ctx, const std::function<float(float, float, float)> &f, float isovalue, float gridMin, float gridMax, float stepSize)
+{
+    MC_PROFILE_SCOPE(StageExtraction);
+    size_t cells = latticeCellCount(gridMin, gridMax, stepSize);
+    reserveTracked(ctx, ctx.coords, cells + 1);
+    ctx.coords.clear();
+    for (float c = gridMin; c < gridMax; c += stepSize)
+        ctx.coords.push_back(c);
+    if (cells > 0)
+        ctx.coords.push_back(ctx.coords.back() + stepSize);
+    size_t points = cells + 1;
+    reserveTracked(ctx, ctx.slabs, 2 * points * points);
+    ctx.slabs.resize(2 * points * points);
+    marchSlabs(ctx, isovalue, [&](size_t i)
+               {
+                   float *values = ctx.slabs.data() + (i % 2) * points * points;
+                   sampleSlab(f, ctx.coords, i, values);
+                   return (const float *)values; });
+}
+
+// Extracts the surface from samples already on a lattice of numCells^3 cells
+// with corners at gridMin + i * stepSize. values holds the (numCells + 1)^3
+// samples indexed [(i * points + j) * points + k], so each x slab is read in
+// place.
+void marchingCubesLattice(ExtractionContext &ctx, const float *values, int numCells, float gridMin, float stepSize, float isovalue)
+{
+    MC_PROFILE_SCOPE(StageExtraction);
+    size_t points = numCells + 1;
+    reserveTracked(ctx, ctx.coords, points);
+    ctx.coords.clear();
+    for (size_t i = 0; i < points; i++)
+        ctx.coords.push_back(gridMin + i * stepSize);
+    marchSlabs(ctx, isovalue, [&](size_t i)
+               { return values + i * points * points; });
+}
+
+std::vector<float> marchingCubes(std::function<float(float, float, float)> f, float isovalue, float gridMin, float gridMax, float stepSize)
+{
+    ExtractionContext ctx;
+    marchingCubes(ctx, f, isovalue, gridMin, gridMax, stepSize);
+    return std::move(ctx.vertices);
+}
+
+// Per-face normals of a triangle soup, written into normals (resized to match
+// vertices, capacity kept).
+void computeNormals(const std::vector<float> &vertices, std::vector<float> &normals)
+{
+    MC_PROFILE_SCOPE(StageNormals);
+    normals.resize(vertices.size());
+    size_t degenerate = 0;
+    for (size_t i = 0; i < vertices.size(); i += 9)
+    {
+        glm::vec3 p0(vertices[i], vertices[i + 1], vertices[i + 2]);
+        glm::vec3 p1(vertices[i + 3], vertices[i + 4], vertices[i + 5]);
+        glm::vec3 p2(vertices[i + 6], vertices[i + 7], vertices[i + 8]);
+        glm::vec3 edge1 = p1 - p0;
+        glm::vec3 edge2 = p2 - p0;
+        glm::vec3 n = glm::normalize(glm::cross(edge1, edge2));
+        degenerate += !(glm::dot(n, n) > 0.0f);
+        for (int j = 0; j < 3; j++)
+        {
+            normals[i + 3 * j] = n.x;
+            normals[i + 3 * j + 1] = n.y;
+            normals[i + 3 * j + 2] = n.z;
+        }
+    }
+    MC_COUNT(CounterDegenerateTriangles, degenerate);
+}
+
+std::vector<float> computeNormals(const std::vector<float> &vertices)
+{
+    std::vector<float> normals;
+    computeNormals(vertices, normals);
+    return normals;
+}
+
+void computeNormals(ExtractionContext &ctx)
+{
+    reserveTracked(ctx, ctx.normals, ctx.vertices.size());
+    computeNormals(ctx.vertices, ctx.normals);
+}
+
+void writePLY(const std::vector<float> &vertices, const std::vector<float> &normals, const std::string &fileName)
+{
+    MC_PROFILE_SCOPE(StagePlyExport);
+    std::ofstream ofs(fileName);
+    if (!ofs)
+    {
+        std::cerr << "Cannot open file " << fileName << " for writing.\n";
+        return;
+    }
+    int numVertices = vertices.size() / 3;
+    int numFaces = numVertices / 3;
+    ofs << "ply\nformat ascii 1.0\n";
+    ofs << "element vertex " << numVertices << "\n";
+    ofs << "property float x\nproperty float y\nproperty float z\n";
+    ofs << "property float nx\nproperty float ny\nproperty float nz\n";
+    ofs << "element face " << numFaces << "\n";
+    ofs << "property list uchar int vertex_indices\n";
+    ofs << "end_header\n";
+    for (int i = 0; i < numVertices; i++)
+    {
+        ofs << vertices[3 * i] << " " << vertices[3 * i + 1] << " " << vertices[3 * i + 2] << " ";
+        ofs << normals[3 * i] << " " << normals[3 * i + 1] << " " << normals[3 * i + 2] << "\n";
+    }
+    for (int i = 0; i < numFaces; i++)
+    {
+        ofs << "3 " << 3 * i << " " << 3 * i + 1 << " " << 3 * i + 2 << "\n";
+    }
+    MC_COUNT(CounterBytesWritten, ofs.tellp());
+    ofs.close();
+    std::cout << "PLY file written: " << fileName << "\n";
+}
+
+void interleaveMesh(const std::vector<float> &vertices, const std::vector<float> &normals, std::vector<float> &interleaved)
+{
+    size_t numVerts = vertices.size() / 3;
+    interleaved.resize(numVerts * 6);
+    for (size_t i = 0; i < numVerts; i++)
+    {
+        interleaved[6 * i] = vertices[3 * i];
+        interleaved[6 * i + 1] = vertices[3 * i + 1];
+        interleaved[6 * i + 2] = vertices[3 * i + 2];
+        interleaved[6 * i + 3] = normals[3 * i];
+        interleaved[6 * i + 4] = normals[3 * i + 1];
+        interleaved[6 * i + 5] = normals[3 * i + 2];
+    }
+}
+
+std::vector<float> interleaveMesh(const std::vector<float> &vertices, const std::vector<float> &normals)
+{
+    std::vector<float> interleaved;
+    interleaveMesh(vertices, normals, interleaved);
+    return interleaved;
+}
+
+void interleaveMesh(ExtractionContext &ctx)
+{
+    reserveTracked(ctx, ctx.interleaved, ctx.vertices.size() * 2);
+    interleaveMesh(ctx.vertices, ctx.normals, ctx.interleaved);
+}
+
+bool selectScalarField(int fieldChoice, std::function<float(float, float, float)> &scalarField, float &isovalue)
+{
+    if (fieldChoice == 1)
+    {
+        scalarField = [](float x, float y, float z) -> float
+        {
+            return y - sin(x) * cos(z);
+        };
+        isovalue = 0.0f;
+    }
+    else if (fieldChoice == 2)
+    {
+        scalarField = [](float x, float y, float z) -> float
+        {
+            return x * x - y * y - z * z - z;
+        };
+        isovalue = -1.5f;
+    }
+    else
+    {
+        std::cerr << "Invalid field choice. Use 1 or 2." << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,240 @@
+#pragma once
+
+// Hot-path instrumentation, compiled in only when MC_PROFILE is defined.
+//
+//   MC_PROFILE_SCOPE(stage)    times the enclosing scope and records it as a
+//                              Chrome trace event
+//   MC_PROFILE_SECTION(stage)  times the enclosing scope into the stage totals
+//                              only; for sections that run many times per
+//                              call, such as once per slab
+//   MC_COUNT(counter, n)       adds n to a counter
+//
+// Each timer reads the clock twice and each update is a shared atomic, so
+// neither belongs in a per-cell loop: time a whole slab or pass, and tally
+// counts in locals that are added once per call.
+//
+// Totals and counters are written to <prefix>.json and the trace events to
+// <prefix>.trace.json when the program exits. Without MC_PROFILE every macro
+// expands to nothing.
+
+#ifdef MC_PROFILE
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+enum ProfileStage
+{
+    StageExtraction,
+    StageFieldEvaluation,
+    StageCaseClassification,
+    StageVertexInterpolation,
+    StageNormals,
+    StagePlyExport,
+    StageGLUpload,
+    StageFrame,
+    ProfileStageCount
+};
+
+const char *profileStageNames[ProfileStageCount] = {
+    "extraction", "field evaluation", "case classification", "vertexInterp", "normals", "PLY export", "GL upload", "frame"};
+
+enum ProfileCounter
+{
+    CounterCellsVisited,
+    CounterActiveCells,
+    CounterTriangles,
+    CounterDegenerateTriangles,
+    CounterBytesWritten,
+    CounterAllocations,
+    CounterAllocatedBytes,
+    ProfileCounterCount
+};
+
+const char *profileCounterNames[ProfileCounterCount] = {
+    "cells visited", "active cells", "triangles", "degenerate triangles", "bytes written", "allocations", "allocated bytes"};
+
+// Plain atomics so they are usable from operator new before main runs.
+std::atomic<uint64_t> profileCounters[ProfileCounterCount];
+std::atomic<uint64_t> profileStageNanoseconds[ProfileStageCount];
+std::atomic<uint64_t> profileStageCalls[ProfileStageCount];
+
+struct TraceEvent
+{
+    int stage;
+    int thread;
+    int64_t startMicroseconds;
+    int64_t durationMicroseconds;
+};
+
+struct ProfilerState
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::mutex mutex;
+    std::vector<TraceEvent> events;
+    std::string outputPrefix = "mcprofile";
+    std::atomic<int> nextThread{0};
+};
+
+const size_t maxTraceEvents = 1 << 20;
+
+ProfilerState &profilerState()
+{
+    static ProfilerState state;
+    return state;
+}
+
+int profilerThreadId()
+{
+    thread_local int id = profilerState().nextThread++;
+    return id;
+}
+
+class ProfileTimer
+{
+public:
+    ProfileTimer(ProfileStage stage, bool trace) : stage(stage), trace(trace), begin(std::chrono::steady_clock::now()) {}
+
+    ~ProfileTimer()
+    {
+        auto end = std::chrono::steady_clock::now();
+        uint64_t ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+        profileStageNanoseconds[stage].fetch_add(ns, std::memory_order_relaxed);
+        profileStageCalls[stage].fetch_add(1, std::memory_order_relaxed);
+        if (!trace)
+            return;
+        ProfilerState &state = profilerState();
+        TraceEvent event;
+        event.stage = stage;
+        event.thread = profilerThreadId();
+        event.startMicroseconds = std::chrono::duration_cast<std::chrono::microseconds>(begin - state.start).count();
+        event.durationMicroseconds = (int64_t)(ns / 1000);
+        std::lock_guard<std::mutex> lock(state.mutex);
+        if (state.events.size() < maxTraceEvents)
+            state.events.push_back(event);
+    }
+
+private:
+    ProfileStage stage;
+    bool trace;
+    std::chrono::steady_clock::time_point begin;
+};
+
+std::vector<std::string> profilerSummaryLines()
+{
+    std::vector<std::string> lines;
+    for (int s = 0; s < ProfileStageCount; s++)
+    {
+        uint64_t calls = profileStageCalls[s].load(std::memory_order_relaxed);
+        if (calls == 0)
+            continue;
+        double ms = profileStageNanoseconds[s].load(std::memory_order_relaxed) / 1e6;
+        lines.push_back(std::string(profileStageNames[s]) + ": " + std::to_string(ms) + " ms (" + std::to_string(calls) + " calls)");
+    }
+    for (int c = 0; c < ProfileCounterCount; c++)
+    {
+        lines.push_back(std::string(profileCounterNames[c]) + ": " + std::to_string(profileCounters[c].load(std::memory_order_relaxed)));
+    }
+    return lines;
+}
+
+void profilerWriteReports()
+{
+    ProfilerState &state = profilerState();
+    std::ofstream json(state.outputPrefix + ".json");
+    if (json)
+    {
+        json << "{\n  \"stages\": {\n";
+        for (int s = 0; s < ProfileStageCount; s++)
+        {
+            json << "    \"" << profileStageNames[s] << "\": {\"total_ms\": " << profileStageNanoseconds[s].load() / 1e6
+                 << ", \"calls\": " << profileStageCalls[s].load() << "}" << (s + 1 < ProfileStageCount ? ",\n" : "\n");
+        }
+        json << "  },\n  \"counters\": {\n";
+        for (int c = 0; c < ProfileCounterCount; c++)
+        {
+            json << "    \"" << profileCounterNames[c] << "\": " << profileCounters[c].load() << (c + 1 < ProfileCounterCount ? ",\n" : "\n");
+        }
+        json << "  }\n}\n";
+    }
+
+    std::ofstream trace(state.outputPrefix + ".trace.json");
+    if (trace)
+    {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        trace << "{\"traceEvents\": [\n";
+        for (size_t i = 0; i < state.events.size(); i++)
+        {
+            const TraceEvent &event = state.events[i];
+            trace << "  {\"name\": \"" << profileStageNames[event.stage] << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.thread
+                  << ", \"ts\": " << event.startMicroseconds << ", \"dur\": " << event.durationMicroseconds << "}"
+                  << (i + 1 < state.events.size() ? ",\n" : "\n");
+        }
+        trace << "]}\n";
+    }
+}
+
+// Writes the reports at exit. The constructor touches profilerState() so the
+// state outlives this object.
+struct ProfilerReportAtExit
+{
+    ProfilerReportAtExit() { profilerState(); }
+    ~ProfilerReportAtExit() { profilerWriteReports(); }
+} profilerReportAtExit;
+
+void *operator new(size_t size)
+{
+    profileCounters[CounterAllocations].fetch_add(1, std::memory_order_relaxed);
+    profileCounters[CounterAllocatedBytes].fetch_add(size, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+#define MC_PROFILE_CONCAT_(a, b) a##b
+#define MC_PROFILE_CONCAT(a, b) MC_PROFILE_CONCAT_(a, b)
+#define MC_PROFILE_SCOPE(stage) ProfileTimer MC_PROFILE_CONCAT(profileTimer, __LINE__)(stage, true)
+#define MC_PROFILE_SECTION(stage) ProfileTimer MC_PROFILE_CONCAT(profileTimer, __LINE__)(stage, false)
+#define MC_COUNT(counter, n) profileCounters[counter].fetch_add((uint64_t)(n), std::memory_order_relaxed)
+#define MC_PROFILE_SET_OUTPUT(prefix) (profilerState().outputPrefix = (prefix))
+
+#else
+
+#define MC_PROFILE_SCOPE(stage)
+#define MC_PROFILE_SECTION(stage)
+// Unevaluated, but keeps locals that only feed a counter from warning.
+#define MC_COUNT(counter, n) ((void)sizeof(n))
+#define MC_PROFILE_SET_OUTPUT(prefix)
+
+#endif
@@ -0,0 +1,355 @@
+#include <vector>
+#include <functional>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+#include "Extraction.hpp"
+
+// Headless benchmark of the extraction pipeline. Every stage is timed on its
+// own over both built-in fields and a range of grid resolutions, and the
+// default 20^3 surfaces are checked against the PLY files in the repository.
+
+#ifndef MC_SOURCE_DIR
+#define MC_SOURCE_DIR "."
+#endif
+
+float gridMin = -5.0f;
+float gridMax = 5.0f;
+
+struct StageResult
+{
+    std::string name;
+    std::vector<double> seconds = {};
+    double bytes = 0.0;
+};
+
+// Peak resident set size of the process. On Linux this is VmHWM, which
+// resetPeakRSS() can clear so the value covers a single run; elsewhere it is
+// the peak since the process started.
+size_t peakRSSBytes()
+{
+#ifdef __linux__
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+    {
+        if (line.compare(0, 6, "VmHWM:") == 0)
+            return (size_t)std::strtoull(line.c_str() + 6, nullptr, 10) * 1024;
+    }
+#endif
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return counters.PeakWorkingSetSize;
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return (size_t)usage.ru_maxrss;
+#else
+    return (size_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+// Resets the peak RSS to the current RSS. Returns false where that is not
+// supported, in which case per-run peaks are not reported.
+bool resetPeakRSS()
+{
+#ifdef __linux__
+    std::ofstream clearRefs("/proc/self/clear_refs");
+    clearRefs << "5";
+    clearRefs.flush();
+    return (bool)clearRefs;
+#else
+    return false;
+#endif
+}
+
+size_t fileSize(const std::string &fileName)
+{
+    std::ifstream ifs(fileName, std::ios::binary | std::ios::ate);
+    return ifs ? (size_t)ifs.tellg() : 0;
+}
+
+// Runs fn warmup times untimed, then reps times timed.
+template <typename Fn>
+std::vector<double> timeStage(int warmup, int reps, Fn fn)
+{
+    for (int i = 0; i < warmup; i++)
+        fn();
+    std::vector<double> seconds;
+    for (int i = 0; i < reps; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    return seconds;
+}
+
+double median(std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    size_t n = values.size();
+    return n % 2 ? values[n / 2] : 0.5 * (values[n / 2 - 1] + values[n / 2]);
+}
+
+std::vector<int> parseList(const std::string &list)
+{
+    std::vector<int> values;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ','))
+        values.push_back(std::atoi(item.c_str()));
+    return values;
+}
+
+std::string referenceFile(const std::string &dir, int field)
+{
+    return dir + (field == 1 ? "/marchingCubesSurfaceOne.ply" : "/marchingCubesSurfaceTwo.ply");
+}
+
+// Compares two PLY files token by token, allowing for the rounding of the
+// ASCII output and for NaN normals of degenerate triangles printed as either
+// "nan" or "-nan".
+bool comparePLY(const std::string &fileA, const std::string &fileB, std::string &message)
+{
+    std::ifstream a(fileA), b(fileB);
+    if (!a || !b)
+    {
+        message = "cannot open " + std::string(!a ? fileA : fileB);
+        return false;
+    }
+    std::string ta, tb;
+    size_t token = 0;
+    while (true)
+    {
+        bool hasA = (bool)(a >> ta);
+        bool hasB = (bool)(b >> tb);
+        if (!hasA || !hasB)
+        {
+            if (hasA != hasB)
+            {
+                message = "files differ in length";
+                return false;
+            }
+            return true;
+        }
+        token++;
+        if (ta == tb)
+            continue;
+        char *endA, *endB;
+        double va = std::strtod(ta.c_str(), &endA);
+        double vb = std::strtod(tb.c_str(), &endB);
+        bool numeric = *endA == '\0' && *endB == '\0';
+        bool match = numeric && ((std::isnan(va) && std::isnan(vb)) ||
+                                 std::fabs(va - vb) <= 1e-4 * std::max(1.0, std::fabs(vb)));
+        if (!match)
+        {
+            message = "token " + std::to_string(token) + ": " + ta + " vs " + tb;
+            return false;
+        }
+    }
+}
+
+void printStage(std::ostream &out, const StageResult &stage, double cells, double triangles, bool last)
+{
+    double med = median(stage.seconds);
+    double best = *std::min_element(stage.seconds.begin(), stage.seconds.end());
+    out << "        \"" << stage.name << "\": {\"median_s\": " << med << ", \"min_s\": " << best
+        << ", \"ns_per_cell\": " << med * 1e9 / cells
+        << ", \"triangles_per_s\": " << (med > 0.0 ? triangles / med : 0.0)
+        << ", \"bytes\": " << stage.bytes
+        << ", \"bytes_per_s\": " << (med > 0.0 ? stage.bytes / med : 0.0) << "}" << (last ? "\n" : ",\n");
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<int> sizes = {20, 32, 64, 128, 256, 512};
+    std::vector<int> fields = {1, 2};
+    int warmup = 1;
+    int reps = 5;
+    std::string outputFile;
+    std::string referenceDir = MC_SOURCE_DIR;
+    std::string scratchFile = "mcbench_scratch.ply";
+    bool writeReferences = false;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--sizes" && i + 1 < argc)
+            sizes = parseList(argv[++i]);
+        else if (arg == "--fields" && i + 1 < argc)
+            fields = parseList(argv[++i]);
+        else if (arg == "--warmup" && i + 1 < argc)
+            warmup = std::atoi(argv[++i]);
+        else if (arg == "--reps" && i + 1 < argc)
+            reps = std::max(std::atoi(argv[++i]), 1);
+        else if (arg == "--out" && i + 1 < argc)
+            outputFile = argv[++i];
+        else if (arg == "--reference-dir" && i + 1 < argc)
+            referenceDir = argv[++i];
+        else if (arg == "--write-references")
+            writeReferences = true;
+        else
+        {
+            std::cerr << "Usage: mcbench [--sizes 20,32,...] [--fields 1,2] [--warmup N] [--reps N]\n"
+                      << "               [--out file.json] [--reference-dir dir] [--write-references]\n";
+            return -1;
+        }
+    }
+
+    std::ofstream file;
+    if (!outputFile.empty())
+    {
+        file.open(outputFile);
+        if (!file)
+        {
+            std::cerr << "Cannot open file " << outputFile << " for writing.\n";
+            return -1;
+        }
+    }
+    std::ostream &out = outputFile.empty() ? std::cout : file;
+    for (int field : fields)
+    {
+        std::function<float(float, float, float)> scalarField;
+        float isovalue;
+        if (!selectScalarField(field, scalarField, isovalue))
+            return -1;
+    }
+    // writePLY reports on std::cout; keep that out of the JSON. Every exit
+    // below goes through the restore at the end.
+    std::streambuf *coutBuffer = std::cout.rdbuf();
+    std::ostringstream discarded;
+    std::cout.rdbuf(discarded.rdbuf());
+
+    bool allMatch = true;
+    std::ostringstream json;
+    json << "{\n  \"warmup\": " << warmup << ",\n  \"reps\": " << reps << ",\n  \"references\": [\n";
+    for (size_t f = 0; f < fields.size(); f++)
+    {
+        std::function<float(float, float, float)> scalarField;
+        float isovalue;
+        selectScalarField(fields[f], scalarField, isovalue);
+        std::vector<float> vertices = marchingCubes(scalarField, isovalue, gridMin, gridMax, 0.5f);
+        std::vector<float> normals = computeNormals(vertices);
+        std::string reference = referenceFile(referenceDir, fields[f]);
+        std::string message;
+        bool match;
+        if (writeReferences)
+        {
+            writePLY(vertices, normals, reference);
+            match = true;
+            message = "written";
+        }
+        else
+        {
+            writePLY(vertices, normals, scratchFile);
+            match = comparePLY(scratchFile, reference, message);
+            if (match)
+                message = "identical surface";
+        }
+        allMatch = allMatch && match;
+        std::cerr << "field " << fields[f] << " reference " << reference << ": " << (match ? "ok" : "MISMATCH") << " (" << message << ")\n";
+        json << "    {\"field\": " << fields[f] << ", \"file\": \"" << reference << "\", \"match\": " << (match ? "true" : "false")
+             << ", \"detail\": \"" << message << "\"}" << (f + 1 < fields.size() ? ",\n" : "\n");
+    }
+    json << "  ],\n  \"runs\": [\n";
+
+    bool firstRun = true;
+    size_t overallPeak = peakRSSBytes();
+    for (int field : fields)
+    {
+        std::function<float(float, float, float)> scalarField;
+        float isovalue;
+        selectScalarField(field, scalarField, isovalue);
+        for (int n : sizes)
+        {
+            float stepSize = latticeStepSize(gridMin, gridMax, n);
+            std::cerr << "field " << field << ", " << n << "^3 cells\n";
+            bool perRunPeak = resetPeakRSS();
+
+            // A fresh context per run so its allocation counts cover this
+            // resolution only; repetitions after the first reuse its buffers.
+            ExtractionContext ctx;
+            StageResult extract{"marchingCubes"};
+            extract.seconds = timeStage(warmup, reps, [&]()
+                                        { marchingCubes(ctx, scalarField, isovalue, gridMin, gridMax, stepSize); });
+            extract.bytes = (double)ctx.vertices.size() * sizeof(float);
+
+            StageResult normal{"computeNormals"};
+            normal.seconds = timeStage(warmup, reps, [&]()
+                                       { computeNormals(ctx); });
+            normal.bytes = (double)ctx.normals.size() * sizeof(float);
+
+            StageResult ply{"writePLY"};
+            ply.seconds = timeStage(warmup, reps, [&]()
+                                    { writePLY(ctx.vertices, ctx.normals, scratchFile); });
+            ply.bytes = (double)fileSize(scratchFile);
+
+            StageResult interleave{"interleave"};
+            interleave.seconds = timeStage(warmup, reps, [&]()
+                                           { interleaveMesh(ctx); });
+            interleave.bytes = (double)ctx.interleaved.size() * sizeof(float);
+
+            // One more full re-extraction into the warm context; this should
+            // not need to grow any buffer.
+            size_t arenaAllocations = ctx.allocations;
+            marchingCubes(ctx, scalarField, isovalue, gridMin, gridMax, stepSize);
+            computeNormals(ctx);
+            interleaveMesh(ctx);
+            size_t steadyAllocations = ctx.allocations - arenaAllocations;
+
+            // The marching loop accumulates x += stepSize, so count cells the
+            // same way rather than assuming n^3.
+            double cellsPerAxis = latticeCellCount(gridMin, gridMax, stepSize);
+            double cells = cellsPerAxis * cellsPerAxis * cellsPerAxis;
+            double triangles = (double)ctx.vertices.size() / 9;
+
+            if (!firstRun)
+                json << ",\n";
+            firstRun = false;
+            json << "    {\n      \"field\": " << field << ",\n      \"resolution\": " << n
+                 << ",\n      \"cells\": " << cells << ",\n      \"triangles\": " << triangles
+                 << ",\n      \"peak_rss_bytes\": ";
+            if (perRunPeak)
+            {
+                size_t peak = peakRSSBytes();
+                overallPeak = std::max(overallPeak, peak);
+                json << peak;
+            }
+            else
+            {
+                json << "null";
+            }
+            json << ",\n      \"arena_allocations\": " << arenaAllocations << ",\n      \"arena_bytes\": " << ctx.allocatedBytes
+                 << ",\n      \"steady_state_allocations\": " << steadyAllocations << ",\n      \"stages\": {\n";
+            printStage(json, extract, cells, triangles, false);
+            printStage(json, normal, cells, triangles, false);
+            printStage(json, ply, cells, triangles, false);
+            printStage(json, interleave, cells, triangles, true);
+            json << "      }\n    }";
+        }
+    }
+    json << "\n  ],\n  \"peak_rss_bytes\": " << std::max(overallPeak, peakRSSBytes()) << "\n}\n";
+
+    std::cout.rdbuf(coutBuffer);
+    std::remove(scratchFile.c_str());
+    out << json.str();
+    return allMatch ? 0 : 1;
+}
@@ -1,5 +1,17 @@
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#ifdef MC_PROFILE
+#include <GL/freeglut.h>
+#endif
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
@@ -8,67 +20,31 @@
 #include <iostream>
 #include <fstream>
 #include <cmath>
-#include "TriTable.hpp"
-
-class Axes
-{
-
-    glm::vec3 origin;
-    glm::vec3 extents;
-
-    glm::vec3 xcol = glm::vec3(1.0f, 0.0f, 0.0f);
-    glm::vec3 ycol = glm::vec3(0.0f, 1.0f, 0.0f);
-    glm::vec3 zcol = glm::vec3(0.0f, 0.0f, 1.0f);
-
-public:
-    Axes(glm::vec3 orig, glm::vec3 ex) : origin(orig), extents(ex) {}
-
-    void draw()
-    {
-
-        glMatrixMode(GL_MODELVIEW);
-        glPushMatrix();
-
-        glLineWidth(2.0f);
-        glBegin(GL_LINES);
-        glColor3f(xcol.x, xcol.y, xcol.z);
-        glVertex3f(origin.x, origin.y, origin.z);
-        glVertex3f(origin.x + extents.x, origin.y, origin.z);
-
-        glVertex3f(origin.x + extents.x, origin.y, origin.z);
-        glVertex3f(origin.x + extents.x, origin.y, origin.z + 0.1);
-        glVertex3f(origin.x + extents.x, origin.y, origin.z);
-        glVertex3f(origin.x + extents.x, origin.y, origin.z - 0.1);
-
-        glColor3f(ycol.x, ycol.y, ycol.z);
-        glVertex3f(origin.x, origin.y, origin.z);
-        glVertex3f(origin.x, origin.y + extents.y, origin.z);
-
-        glVertex3f(origin.x, origin.y + extents.y, origin.z);
-        glVertex3f(origin.x, origin.y + extents.y, origin.z + 0.1);
-        glVertex3f(origin.x, origin.y + extents.y, origin.z);
-        glVertex3f(origin.x, origin.y + extents.y, origin.z - 0.1);
-
-        glColor3f(zcol.x, zcol.y, zcol.z);
-        glVertex3f(origin.x, origin.y, origin.z);
-        glVertex3f(origin.x, origin.y, origin.z + extents.z);
-
-        glVertex3f(origin.x, origin.y, origin.z + extents.z);
-        glVertex3f(origin.x + 0.1, origin.y, origin.z + extents.z);
-
-        glVertex3f(origin.x, origin.y, origin.z + extents.z);
-        glVertex3f(origin.x - 0.1, origin.y, origin.z + extents.z);
-        glEnd();
-
-        glPopMatrix();
-    }
-};
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <initializer_list>
+#include <memory>
+#include <unordered_map>
+#include "Extraction.hpp"
 
 float cam_r = 8.66f;
 float cam_theta = glm::radians(45.0f);
 float cam_phi = glm::radians(55.0f);
 double lastX, lastY;
 bool mousePressed = false;
+bool brushPressed = false;
+bool brushCarves = false;
+float brushRadius = 1.0f;
+bool showHud = true;
+bool redrawNeeded = true;
+glm::mat4 projection = glm::perspective(glm::radians(45.0f), 800.0f / 600.0f, 0.1f, 100.0f);
 
 float gridMin = -5.0f;
 float gridMax = 5.0f;
@@ -76,6 +52,7 @@ float stepSize = 0.5f;
 
 void mouse_button_callback(GLFWwindow *window, int button, int action, int mods)
 {
+    redrawNeeded = true;
     if (button == GLFW_MOUSE_BUTTON_LEFT)
     {
         if (action == GLFW_PRESS)
@@ -88,12 +65,20 @@ void mouse_button_callback(GLFWwindow *window, int button, int action, int mods)
             mousePressed = false;
         }
     }
+    if (button == GLFW_MOUSE_BUTTON_RIGHT)
+    {
+        brushPressed = (action == GLFW_PRESS);
+        brushCarves = (mods & GLFW_MOD_SHIFT) != 0;
+    }
 }
 
 void cursor_position_callback(GLFWwindow *window, double xpos, double ypos)
 {
+    if (brushPressed)
+        redrawNeeded = true;
     if (mousePressed)
     {
+        redrawNeeded = true;
         float dx = float(xpos - lastX);
         float dy = float(ypos - lastY);
         lastX = xpos;
@@ -111,6 +96,7 @@ void key_callback(GLFWwindow *window, int key, int scancode, int action, int mod
 {
     if (action == GLFW_PRESS || action == GLFW_REPEAT)
     {
+        redrawNeeded = true;
         if (key == GLFW_KEY_UP)
         {
             cam_r -= 0.5f;
@@ -121,9 +107,37 @@ void key_callback(GLFWwindow *window, int key, int scancode, int action, int mod
         {
             cam_r += 0.5f;
         }
+        if (key == GLFW_KEY_H && action == GLFW_PRESS)
+        {
+            showHud = !showHud;
+        }
+        if (key == GLFW_KEY_EQUAL)
+        {
+            brushRadius += 0.25f;
+        }
+        if (key == GLFW_KEY_MINUS)
+        {
+            brushRadius -= 0.25f;
+            if (brushRadius < 0.25f)
+                brushRadius = 0.25f;
+        }
     }
 }
 
+void framebuffer_size_callback(GLFWwindow *window, int width, int height)
+{
+    if (width <= 0 || height <= 0)
+        return;
+    glViewport(0, 0, width, height);
+    projection = glm::perspective(glm::radians(45.0f), float(width) / float(height), 0.1f, 100.0f);
+    redrawNeeded = true;
+}
+
+void window_refresh_callback(GLFWwindow *window)
+{
+    redrawNeeded = true;
+}
+
 glm::vec3 computeCameraPos()
 {
     float x = cam_r * sin(cam_phi) * cos(cam_theta);
@@ -132,223 +146,1700 @@ glm::vec3 computeCameraPos()
     return glm::vec3(x, y, z);
 }
 
-glm::vec3 vertexInterp(float isovalue, const glm::vec3 &p1, const glm::vec3 &p2, float valp1, float valp2)
+std::vector<float> computeVertexNormals(const std::vector<float> &vertices, const std::vector<uint32_t> &indices)
+{
+    std::vector<float> normals(vertices.size(), 0.0f);
+    for (size_t i = 0; i < indices.size(); i += 3)
+    {
+        uint32_t a = indices[i], b = indices[i + 1], c = indices[i + 2];
+        glm::vec3 p0(vertices[3 * a], vertices[3 * a + 1], vertices[3 * a + 2]);
+        glm::vec3 p1(vertices[3 * b], vertices[3 * b + 1], vertices[3 * b + 2]);
+        glm::vec3 p2(vertices[3 * c], vertices[3 * c + 1], vertices[3 * c + 2]);
+        // Unnormalized cross product, so larger faces weigh more.
+        glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+        for (uint32_t v : {a, b, c})
+        {
+            normals[3 * v] += n.x;
+            normals[3 * v + 1] += n.y;
+            normals[3 * v + 2] += n.z;
+        }
+    }
+    for (size_t i = 0; i < normals.size(); i += 3)
+    {
+        glm::vec3 n(normals[i], normals[i + 1], normals[i + 2]);
+        float len = glm::length(n);
+        if (len > 0.0f)
+            n /= len;
+        normals[i] = n.x;
+        normals[i + 1] = n.y;
+        normals[i + 2] = n.z;
+    }
+    return normals;
+}
+
+void writeIndexedPLY(const std::vector<float> &vertices, const std::vector<float> &normals, const std::vector<uint32_t> &indices, const std::string &fileName)
 {
-    if (fabs(isovalue - valp1) < 0.00001f)
-        return p1;
-    if (fabs(isovalue - valp2) < 0.00001f)
-        return p2;
-    if (fabs(valp1 - valp2) < 0.00001f)
-        return p1;
-    float mu = (isovalue - valp1) / (valp2 - valp1);
-    return p1 + mu * (p2 - p1);
+    MC_PROFILE_SCOPE(StagePlyExport);
+    std::ofstream ofs(fileName);
+    if (!ofs)
+    {
+        std::cerr << "Cannot open file " << fileName << " for writing.\n";
+        return;
+    }
+    size_t numVertices = vertices.size() / 3;
+    size_t numFaces = indices.size() / 3;
+    ofs << "ply\nformat ascii 1.0\n";
+    ofs << "element vertex " << numVertices << "\n";
+    ofs << "property float x\nproperty float y\nproperty float z\n";
+    ofs << "property float nx\nproperty float ny\nproperty float nz\n";
+    ofs << "element face " << numFaces << "\n";
+    ofs << "property list uchar int vertex_indices\n";
+    ofs << "end_header\n";
+    for (size_t i = 0; i < numVertices; i++)
+    {
+        ofs << vertices[3 * i] << " " << vertices[3 * i + 1] << " " << vertices[3 * i + 2] << " ";
+        ofs << normals[3 * i] << " " << normals[3 * i + 1] << " " << normals[3 * i + 2] << "\n";
+    }
+    for (size_t i = 0; i < numFaces; i++)
+    {
+        ofs << "3 " << indices[3 * i] << " " << indices[3 * i + 1] << " " << indices[3 * i + 2] << "\n";
+    }
+    MC_COUNT(CounterBytesWritten, ofs.tellp());
+    ofs.close();
+    std::cout << "PLY file written: " << fileName << "\n";
 }
 
-int edgeIndex[12][2] = {
-    {0, 1}, {1, 2}, {2, 3}, {3, 0}, {4, 5}, {5, 6}, {6, 7}, {7, 4}, {0, 4}, {1, 5}, {2, 6}, {3, 7}};
+// Tiled extraction. The domain is treated as a lattice of numCells^3 cells whose
+// corners sit at gridMin + i * stepSize. Every surface vertex lies on a lattice
+// edge, so the edge id is a global key that two tiles sharing a face agree on.
+
+struct TileRange
+{
+    int begin[3];
+    int end[3];
+};
 
-std::vector<float> marchingCubes(std::function<float(float, float, float)> f, float isovalue, float gridMin, float gridMax, float stepSize)
+struct TileMesh
 {
+    // The extraction the tile belongs to, so a merge can reject tiles that do
+    // not fit together.
+    int32_t field = 0;
+    float isovalue = 0.0f;
+    float gridMin = 0.0f;
+    float stepSize = 0.0f;
+    uint32_t numCells = 0;
+    uint32_t tileIndex = 0;
+    uint32_t numTiles = 0;
     std::vector<float> vertices;
-    glm::vec3 vertexOffset[8] = {
-        glm::vec3(0, 0, 0),
-        glm::vec3(stepSize, 0, 0),
-        glm::vec3(stepSize, 0, stepSize),
-        glm::vec3(0, 0, stepSize),
-        glm::vec3(0, stepSize, 0),
-        glm::vec3(stepSize, stepSize, 0),
-        glm::vec3(stepSize, stepSize, stepSize),
-        glm::vec3(0, stepSize, stepSize)};
+    std::vector<uint32_t> indices;
+    // Vertices on a face shared with another tile, keyed by global edge id.
+    std::vector<uint32_t> boundaryVertices;
+    std::vector<uint64_t> boundaryKeys;
+};
+
+uint64_t globalEdgeId(int numCells, int i, int j, int k, int axis)
+{
+    uint64_t points = (uint64_t)numCells + 1;
+    return (((uint64_t)i * points + j) * points + k) * 3 + axis;
+}
+
+// Splits the cell lattice into numTiles boxes, giving each prime factor of
+// numTiles to whichever axis has been split the least so far.
+std::vector<TileRange> makeTiles(int numCells, int numTiles)
+{
+    int splits[3] = {1, 1, 1};
+    std::vector<int> factors;
+    int n = numTiles;
+    for (int p = 2; p * p <= n; p++)
+    {
+        while (n % p == 0)
+        {
+            factors.push_back(p);
+            n /= p;
+        }
+    }
+    if (n > 1)
+        factors.push_back(n);
+    for (int i = (int)factors.size() - 1; i >= 0; i--)
+    {
+        int axis = 0;
+        for (int a = 1; a < 3; a++)
+        {
+            if (splits[a] < splits[axis])
+                axis = a;
+        }
+        splits[axis] *= factors[i];
+    }
 
-    for (float x = gridMin; x < gridMax; x += stepSize)
+    std::vector<TileRange> tiles;
+    for (int tx = 0; tx < splits[0]; tx++)
     {
-        for (float y = gridMin; y < gridMax; y += stepSize)
+        for (int ty = 0; ty < splits[1]; ty++)
         {
-            for (float z = gridMin; z < gridMax; z += stepSize)
+            for (int tz = 0; tz < splits[2]; tz++)
             {
-                glm::vec3 cubePos(x, y, z);
-                float cubeValues[8];
-                glm::vec3 cubeVerts[8];
-                for (int i = 0; i < 8; i++)
+                int t[3] = {tx, ty, tz};
+                TileRange range;
+                for (int a = 0; a < 3; a++)
                 {
-                    cubeVerts[i] = cubePos + vertexOffset[i];
-                    cubeValues[i] = f(cubeVerts[i].x, cubeVerts[i].y, cubeVerts[i].z);
+                    range.begin[a] = (int)((int64_t)numCells * t[a] / splits[a]);
+                    range.end[a] = (int)((int64_t)numCells * (t[a] + 1) / splits[a]);
                 }
+                tiles.push_back(range);
+            }
+        }
+    }
+    return tiles;
+}
+
+TileMesh extractTile(std::function<float(float, float, float)> f, float isovalue, float gridMin, float stepSize, int numCells, const TileRange &tile)
+{
+    MC_PROFILE_SCOPE(StageExtraction);
+    TileMesh mesh;
+    mesh.numCells = numCells;
+
+    int dims[3];
+    for (int a = 0; a < 3; a++)
+        dims[a] = tile.end[a] - tile.begin[a];
+    if (dims[0] <= 0 || dims[1] <= 0 || dims[2] <= 0)
+        return mesh;
+
+    // Sample each lattice point of the tile once.
+    int py = dims[1] + 1, pz = dims[2] + 1;
+    std::vector<float> values((size_t)(dims[0] + 1) * py * pz);
+    for (int i = 0; i <= dims[0]; i++)
+    {
+        for (int j = 0; j <= dims[1]; j++)
+        {
+            for (int k = 0; k <= dims[2]; k++)
+            {
+                float x = gridMin + (tile.begin[0] + i) * stepSize;
+                float y = gridMin + (tile.begin[1] + j) * stepSize;
+                float z = gridMin + (tile.begin[2] + k) * stepSize;
+                values[((size_t)i * py + j) * pz + k] = f(x, y, z);
+            }
+        }
+    }
+
+    std::unordered_map<uint64_t, uint32_t> vertexForEdge;
+    size_t activeCells = 0;
+    for (int i = 0; i < dims[0]; i++)
+    {
+        for (int j = 0; j < dims[1]; j++)
+        {
+            for (int k = 0; k < dims[2]; k++)
+            {
+                float cubeValues[8];
                 int cubeIndex = 0;
-                for (int i = 0; i < 8; i++)
+                for (int c = 0; c < 8; c++)
                 {
-                    if (cubeValues[i] < isovalue)
-                        cubeIndex |= (1 << i);
+                    cubeValues[c] = values[((size_t)(i + cornerOffset[c][0]) * py + j + cornerOffset[c][1]) * pz + k + cornerOffset[c][2]];
+                    if (cubeValues[c] < isovalue)
+                        cubeIndex |= (1 << c);
                 }
-                if (marching_cubes_lut[cubeIndex][0] == -1)
-                    continue;
-                for (int i = 0; marching_cubes_lut[cubeIndex][i] != -1; i += 3)
+                activeCells += marching_cubes_lut[cubeIndex][0] != -1;
+                for (int t = 0; marching_cubes_lut[cubeIndex][t] != -1; t++)
                 {
-                    glm::vec3 triVerts[3];
-                    for (int j = 0; j < 3; j++)
+                    int edge = marching_cubes_lut[cubeIndex][t];
+                    int v1 = edgeIndex[edge][0];
+                    int v2 = edgeIndex[edge][1];
+                    // Always interpolate from the lower lattice point so both
+                    // tiles touching an edge compute the same position.
+                    int lo = v1, hi = v2;
+                    int axis = 0;
+                    for (int a = 0; a < 3; a++)
                     {
-                        int edge = marching_cubes_lut[cubeIndex][i + j];
-                        int v1 = edgeIndex[edge][0];
-                        int v2 = edgeIndex[edge][1];
-                        triVerts[j] = vertexInterp(isovalue, cubeVerts[v1], cubeVerts[v2], cubeValues[v1], cubeValues[v2]);
+                        if (cornerOffset[v1][a] != cornerOffset[v2][a])
+                        {
+                            axis = a;
+                            if (cornerOffset[v1][a] > cornerOffset[v2][a])
+                                std::swap(lo, hi);
+                        }
                     }
-                    for (int j = 0; j < 3; j++)
+                    int p[3] = {tile.begin[0] + i + cornerOffset[lo][0],
+                                tile.begin[1] + j + cornerOffset[lo][1],
+                                tile.begin[2] + k + cornerOffset[lo][2]};
+                    uint64_t key = globalEdgeId(numCells, p[0], p[1], p[2], axis);
+
+                    auto found = vertexForEdge.find(key);
+                    if (found != vertexForEdge.end())
+                    {
+                        mesh.indices.push_back(found->second);
+                        continue;
+                    }
+                    glm::vec3 pLo(gridMin + p[0] * stepSize, gridMin + p[1] * stepSize, gridMin + p[2] * stepSize);
+                    glm::vec3 pHi = pLo;
+                    pHi[axis] = gridMin + (p[axis] + 1) * stepSize;
+                    glm::vec3 v = vertexInterp(isovalue, pLo, pHi, cubeValues[lo], cubeValues[hi]);
+
+                    uint32_t index = (uint32_t)(mesh.vertices.size() / 3);
+                    mesh.vertices.push_back(v.x);
+                    mesh.vertices.push_back(v.y);
+                    mesh.vertices.push_back(v.z);
+                    mesh.indices.push_back(index);
+                    vertexForEdge.emplace(key, index);
+
+                    bool onSeam = false;
+                    for (int a = 0; a < 3; a++)
+                    {
+                        if (a == axis)
+                            continue;
+                        if ((p[a] == tile.begin[a] && tile.begin[a] > 0) || (p[a] == tile.end[a] && tile.end[a] < numCells))
+                            onSeam = true;
+                    }
+                    if (onSeam)
                     {
-                        vertices.push_back(triVerts[j].x);
-                        vertices.push_back(triVerts[j].y);
-                        vertices.push_back(triVerts[j].z);
+                        mesh.boundaryVertices.push_back(index);
+                        mesh.boundaryKeys.push_back(key);
                     }
                 }
             }
-        }
-    }
-    return vertices;
-}
+        }
+    }
+    MC_COUNT(CounterCellsVisited, (size_t)dims[0] * dims[1] * dims[2]);
+    MC_COUNT(CounterActiveCells, activeCells);
+    MC_COUNT(CounterTriangles, mesh.indices.size() / 3);
+    return mesh;
+}
+
+struct TileFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    int32_t field;
+    float isovalue;
+    float gridMin;
+    float stepSize;
+    uint32_t numCells;
+    uint32_t tileIndex;
+    uint32_t numTiles;
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    uint32_t boundaryCount;
+};
+
+const char tileFileMagic[8] = {'M', 'C', 'T', 'I', 'L', 'E', '\0', '\0'};
+const uint32_t tileFileVersion = 2;
+
+bool writeTileMesh(const TileMesh &mesh, const std::string &fileName)
+{
+    std::ofstream ofs(fileName, std::ios::binary);
+    if (!ofs)
+    {
+        std::cerr << "Cannot open file " << fileName << " for writing.\n";
+        return false;
+    }
+    TileFileHeader header = {};
+    std::copy(tileFileMagic, tileFileMagic + 8, header.magic);
+    header.version = tileFileVersion;
+    header.field = mesh.field;
+    header.isovalue = mesh.isovalue;
+    header.gridMin = mesh.gridMin;
+    header.stepSize = mesh.stepSize;
+    header.numCells = mesh.numCells;
+    header.tileIndex = mesh.tileIndex;
+    header.numTiles = mesh.numTiles;
+    header.vertexCount = (uint32_t)(mesh.vertices.size() / 3);
+    header.indexCount = (uint32_t)mesh.indices.size();
+    header.boundaryCount = (uint32_t)mesh.boundaryVertices.size();
+    ofs.write((const char *)&header, sizeof(header));
+    ofs.write((const char *)mesh.vertices.data(), mesh.vertices.size() * sizeof(float));
+    ofs.write((const char *)mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t));
+    ofs.write((const char *)mesh.boundaryVertices.data(), mesh.boundaryVertices.size() * sizeof(uint32_t));
+    ofs.write((const char *)mesh.boundaryKeys.data(), mesh.boundaryKeys.size() * sizeof(uint64_t));
+    if (!ofs)
+    {
+        std::cerr << "Failed writing tile file " << fileName << "\n";
+        return false;
+    }
+    MC_COUNT(CounterBytesWritten, ofs.tellp());
+    return true;
+}
+
+bool readTileMesh(TileMesh &mesh, const std::string &fileName)
+{
+    std::ifstream ifs(fileName, std::ios::binary | std::ios::ate);
+    if (!ifs)
+    {
+        std::cerr << "Cannot open tile file " << fileName << "\n";
+        return false;
+    }
+    uint64_t fileSize = (uint64_t)ifs.tellg();
+    ifs.seekg(0);
+    TileFileHeader header;
+    ifs.read((char *)&header, sizeof(header));
+    if (!ifs || !std::equal(tileFileMagic, tileFileMagic + 8, header.magic) || header.version != tileFileVersion)
+    {
+        std::cerr << fileName << " is not a tile file.\n";
+        return false;
+    }
+    uint64_t payload = (uint64_t)header.vertexCount * 3 * sizeof(float) + (uint64_t)header.indexCount * sizeof(uint32_t) +
+                       (uint64_t)header.boundaryCount * (sizeof(uint32_t) + sizeof(uint64_t));
+    if (fileSize - sizeof(header) < payload)
+    {
+        std::cerr << "Tile file " << fileName << " is truncated.\n";
+        return false;
+    }
+    mesh.field = header.field;
+    mesh.isovalue = header.isovalue;
+    mesh.gridMin = header.gridMin;
+    mesh.stepSize = header.stepSize;
+    mesh.numCells = header.numCells;
+    mesh.tileIndex = header.tileIndex;
+    mesh.numTiles = header.numTiles;
+    mesh.vertices.resize((size_t)header.vertexCount * 3);
+    mesh.indices.resize(header.indexCount);
+    mesh.boundaryVertices.resize(header.boundaryCount);
+    mesh.boundaryKeys.resize(header.boundaryCount);
+    ifs.read((char *)mesh.vertices.data(), mesh.vertices.size() * sizeof(float));
+    ifs.read((char *)mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t));
+    ifs.read((char *)mesh.boundaryVertices.data(), mesh.boundaryVertices.size() * sizeof(uint32_t));
+    ifs.read((char *)mesh.boundaryKeys.data(), mesh.boundaryKeys.size() * sizeof(uint64_t));
+    if (!ifs)
+    {
+        std::cerr << "Tile file " << fileName << " is truncated.\n";
+        return false;
+    }
+    bool valid = mesh.indices.size() % 3 == 0 && mesh.tileIndex < mesh.numTiles;
+    for (uint32_t index : mesh.indices)
+        valid = valid && index < header.vertexCount;
+    for (uint32_t index : mesh.boundaryVertices)
+        valid = valid && index < header.vertexCount;
+    if (!valid)
+    {
+        std::cerr << "Tile file " << fileName << " is corrupted.\n";
+        return false;
+    }
+    return true;
+}
+
+// Welds the seam vertices of all tiles and writes a single PLY.
+bool mergeTiles(const std::vector<std::string> &tileFiles, const std::string &fileName)
+{
+    std::vector<float> vertices;
+    std::vector<uint32_t> indices;
+    std::unordered_map<uint64_t, uint32_t> seamVertex;
+    TileMesh first;
+    std::vector<bool> seen;
+    size_t welded = 0;
+
+    for (const std::string &tileFile : tileFiles)
+    {
+        TileMesh tile;
+        if (!readTileMesh(tile, tileFile))
+            return false;
+        if (seen.empty())
+        {
+            first.field = tile.field;
+            first.isovalue = tile.isovalue;
+            first.gridMin = tile.gridMin;
+            first.stepSize = tile.stepSize;
+            first.numCells = tile.numCells;
+            first.numTiles = tile.numTiles;
+            seen.resize(tile.numTiles, false);
+        }
+        if (tile.field != first.field || tile.isovalue != first.isovalue || tile.gridMin != first.gridMin ||
+            tile.stepSize != first.stepSize || tile.numCells != first.numCells || tile.numTiles != first.numTiles)
+        {
+            std::cerr << tileFile << " was extracted from a different field or grid.\n";
+            return false;
+        }
+        if (seen[tile.tileIndex])
+        {
+            std::cerr << tileFile << " repeats tile " << tile.tileIndex << ".\n";
+            return false;
+        }
+        seen[tile.tileIndex] = true;
+
+        uint32_t tileVertexCount = (uint32_t)(tile.vertices.size() / 3);
+        std::vector<uint32_t> remap(tileVertexCount, UINT32_MAX);
+        for (size_t i = 0; i < tile.boundaryVertices.size(); i++)
+        {
+            auto inserted = seamVertex.emplace(tile.boundaryKeys[i], (uint32_t)(vertices.size() / 3));
+            uint32_t local = tile.boundaryVertices[i];
+            if (inserted.second)
+            {
+                vertices.insert(vertices.end(), &tile.vertices[3 * local], &tile.vertices[3 * local] + 3);
+            }
+            else
+            {
+                welded++;
+            }
+            remap[local] = inserted.first->second;
+        }
+        for (uint32_t v = 0; v < tileVertexCount; v++)
+        {
+            if (remap[v] != UINT32_MAX)
+                continue;
+            remap[v] = (uint32_t)(vertices.size() / 3);
+            vertices.insert(vertices.end(), &tile.vertices[3 * v], &tile.vertices[3 * v] + 3);
+        }
+        for (uint32_t index : tile.indices)
+            indices.push_back(remap[index]);
+    }
+    for (size_t i = 0; i < seen.size(); i++)
+    {
+        if (!seen[i])
+        {
+            std::cerr << "Tile " << i << " of " << seen.size() << " is missing.\n";
+            return false;
+        }
+    }
+    if (seen.empty())
+    {
+        std::cerr << "No tiles to merge.\n";
+        return false;
+    }
+
+    std::cout << "Merged " << tileFiles.size() << " tiles: " << vertices.size() / 3 << " vertices, "
+              << indices.size() / 3 << " triangles, " << welded << " seam vertices welded\n";
+    std::vector<float> normals = computeVertexNormals(vertices, indices);
+    writeIndexedPLY(vertices, normals, indices, fileName);
+    return true;
+}
+
+std::string tileFileName(const std::string &outputFile, int tileIndex)
+{
+    return outputFile + ".tile" + std::to_string(tileIndex) + ".bin";
+}
+
+bool runTileWorker(std::function<float(float, float, float)> f, int fieldChoice, float isovalue, int tileIndex, int numTiles, const std::string &tileFile)
+{
+    int numCells = latticeCellCount(gridMin, gridMax, stepSize);
+    std::vector<TileRange> tiles = makeTiles(numCells, numTiles);
+    if (tileIndex < 0 || tileIndex >= (int)tiles.size())
+    {
+        std::cerr << "Tile index " << tileIndex << " out of range for " << numTiles << " tiles.\n";
+        return false;
+    }
+    MC_PROFILE_SET_OUTPUT(tileFile);
+    TileMesh mesh = extractTile(f, isovalue, gridMin, stepSize, numCells, tiles[tileIndex]);
+    mesh.field = fieldChoice;
+    mesh.isovalue = isovalue;
+    mesh.gridMin = gridMin;
+    mesh.stepSize = stepSize;
+    mesh.tileIndex = tileIndex;
+    mesh.numTiles = numTiles;
+    return writeTileMesh(mesh, tileFile);
+}
+
+// Launches one worker process per tile, waits for all of them and merges.
+bool runTiledExtraction(const std::string &executable, int fieldChoice, int resolution, int numTiles, const std::string &outputFile)
+{
+    std::vector<std::string> tileFiles;
+    std::vector<int> results(numTiles, -1);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < numTiles; i++)
+    {
+        tileFiles.push_back(tileFileName(outputFile, i));
+        std::string command = "\"" + executable + "\" " + std::to_string(fieldChoice) + " --resolution " + std::to_string(resolution) + " --tile " +
+                              std::to_string(i) + " " + std::to_string(numTiles) + " \"" + tileFiles[i] + "\"";
+#ifdef _WIN32
+        // cmd.exe strips the outermost pair of quotes.
+        command = "\"" + command + "\"";
+#endif
+        workers.emplace_back([command, i, &results]()
+                             { results[i] = std::system(command.c_str()); });
+    }
+    for (std::thread &worker : workers)
+        worker.join();
+    for (int i = 0; i < numTiles; i++)
+    {
+        if (results[i] != 0)
+        {
+            std::cerr << "Tile worker " << i << " failed.\n";
+            return false;
+        }
+    }
+
+    bool merged = mergeTiles(tileFiles, outputFile);
+    if (merged)
+    {
+        for (const std::string &tileFile : tileFiles)
+            std::remove(tileFile.c_str());
+    }
+    return merged;
+}
+
+GLuint compileShader(const char *vertexSource, const char *fragmentSource)
+{
+    GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(vertexShader, 1, &vertexSource, nullptr);
+    glCompileShader(vertexShader);
+    GLint success;
+    glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &success);
+    if (!success)
+    {
+        char infoLog[512];
+        glGetShaderInfoLog(vertexShader, 512, nullptr, infoLog);
+        std::cerr << "Vertex shader compilation failed:\n"
+                  << infoLog << "\n";
+    }
+
+    GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(fragmentShader, 1, &fragmentSource, nullptr);
+    glCompileShader(fragmentShader);
+    glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &success);
+    if (!success)
+    {
+        char infoLog[512];
+        glGetShaderInfoLog(fragmentShader, 512, nullptr, infoLog);
+        std::cerr << "Fragment shader compilation failed:\n"
+                  << infoLog << "\n";
+    }
+
+    GLuint shaderProgram = glCreateProgram();
+    glAttachShader(shaderProgram, vertexShader);
+    glAttachShader(shaderProgram, fragmentShader);
+    glLinkProgram(shaderProgram);
+    glGetProgramiv(shaderProgram, GL_LINK_STATUS, &success);
+    if (!success)
+    {
+        char infoLog[512];
+        glGetProgramInfoLog(shaderProgram, 512, nullptr, infoLog);
+        std::cerr << "Shader linking failed:\n"
+                  << infoLog << "\n";
+    }
+    glDeleteShader(vertexShader);
+    glDeleteShader(fragmentShader);
+    return shaderProgram;
+}
+
+void createMeshBuffers(GLuint &VAO, GLuint &VBO, ExtractionContext &ctx)
+{
+    MC_PROFILE_SCOPE(StageGLUpload);
+    interleaveMesh(ctx);
+    const std::vector<float> &interleaved = ctx.interleaved;
+
+    glGenVertexArrays(1, &VAO);
+    glGenBuffers(1, &VBO);
+
+    glBindVertexArray(VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, VBO);
+    glBufferData(GL_ARRAY_BUFFER, interleaved.size() * sizeof(float), interleaved.data(), GL_STATIC_DRAW);
+
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void *)0);
+    glEnableVertexAttribArray(0);
+
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void *)(3 * sizeof(float)));
+    glEnableVertexAttribArray(1);
+
+    glBindVertexArray(0);
+}
+
+// Compact vertex format for the static mesh: positions quantized to 16 bits
+// across the grid box and octahedron-encoded normals, 12 bytes instead of the
+// 24 bytes of the float interleaved layout. The vertex shader decodes both.
+struct PackedVertex
+{
+    uint16_t position[4]; // x, y, z, padding
+    int16_t normal[2];
+};
+
+int16_t toSnorm16(float v)
+{
+    return (int16_t)std::lround(std::max(-1.0f, std::min(1.0f, v)) * 32767.0f);
+}
+
+void octEncode(glm::vec3 n, int16_t out[2])
+{
+    float l1 = fabs(n.x) + fabs(n.y) + fabs(n.z);
+    if (!(l1 > 0.0f))
+    {
+        out[0] = out[1] = 0;
+        return;
+    }
+    n /= l1;
+    float x = n.x, y = n.y;
+    if (n.z < 0.0f)
+    {
+        x = (1.0f - fabs(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f);
+        y = (1.0f - fabs(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f);
+    }
+    out[0] = toSnorm16(x);
+    out[1] = toSnorm16(y);
+}
+
+PackedVertex packVertex(const float *position, const float *normal, float boxMin, float boxMax)
+{
+    PackedVertex packed;
+    float scale = 65535.0f / (boxMax - boxMin);
+    for (int a = 0; a < 3; a++)
+    {
+        float q = (position[a] - boxMin) * scale;
+        packed.position[a] = (uint16_t)std::lround(std::max(0.0f, std::min(65535.0f, q)));
+    }
+    packed.position[3] = 0;
+    octEncode(glm::vec3(normal[0], normal[1], normal[2]), packed.normal);
+    return packed;
+}
+
+// Quantizes a triangle list and merges vertices that become bit-identical.
+void packMesh(const std::vector<float> &vertices, const std::vector<float> &normals, float boxMin, float boxMax,
+              std::vector<PackedVertex> &packed, std::vector<uint32_t> &indices)
+{
+    struct PackedHash
+    {
+        size_t operator()(const PackedVertex &v) const
+        {
+            uint64_t h = ((uint64_t)v.position[0] << 32) ^ ((uint64_t)v.position[1] << 16) ^ v.position[2];
+            h ^= ((uint64_t)(uint16_t)v.normal[0] << 40) ^ ((uint64_t)(uint16_t)v.normal[1] << 8);
+            return std::hash<uint64_t>()(h);
+        }
+    };
+    struct PackedEqual
+    {
+        bool operator()(const PackedVertex &a, const PackedVertex &b) const
+        {
+            return std::equal(a.position, a.position + 3, b.position) && a.normal[0] == b.normal[0] && a.normal[1] == b.normal[1];
+        }
+    };
+    std::unordered_map<PackedVertex, uint32_t, PackedHash, PackedEqual> unique;
+    size_t numVerts = vertices.size() / 3;
+    packed.clear();
+    indices.clear();
+    indices.reserve(numVerts);
+    for (size_t i = 0; i < numVerts; i++)
+    {
+        PackedVertex v = packVertex(&vertices[3 * i], &normals[3 * i], boxMin, boxMax);
+        auto inserted = unique.emplace(v, (uint32_t)packed.size());
+        if (inserted.second)
+            packed.push_back(v);
+        indices.push_back(inserted.first->second);
+    }
+}
+
+struct PackedMeshBuffers
+{
+    GLuint VAO = 0;
+    GLuint VBO = 0;
+    GLuint EBO = 0;
+    GLsizei indexCount = 0;
+    GLenum indexType = GL_UNSIGNED_INT;
+    float boxMin = 0.0f;
+    float boxMax = 1.0f;
+};
+
+struct PackedMesh
+{
+    std::vector<PackedVertex> vertices;
+    std::vector<uint32_t> indices;
+    float boxMin = 0.0f;
+    float boxMax = 1.0f;
+};
+
+void buildPackedMesh(PackedMesh &mesh, const std::vector<float> &vertices, const std::vector<float> &normals, float gridMin, float gridMax)
+{
+    // The marching loop can step one cell past gridMax, so widen the
+    // quantization box to cover every vertex.
+    mesh.boxMin = gridMin;
+    mesh.boxMax = gridMax;
+    for (float v : vertices)
+    {
+        mesh.boxMin = std::min(mesh.boxMin, v);
+        mesh.boxMax = std::max(mesh.boxMax, v);
+    }
+    // Normals are per face, so vertices are shared only where a triangle
+    // pair is coplanar and there is little for a cache reorder to exploit.
+    // packMesh already numbers vertices in order of first use, which keeps
+    // vertex fetches sequential.
+    packMesh(vertices, normals, mesh.boxMin, mesh.boxMax, mesh.vertices, mesh.indices);
+}
+
+void uploadPackedMesh(PackedMeshBuffers &buffers, const PackedVertex *vertices, size_t vertexCount, const std::vector<uint32_t> &indices, float boxMin, float boxMax)
+{
+    MC_PROFILE_SCOPE(StageGLUpload);
+    glGenVertexArrays(1, &buffers.VAO);
+    glGenBuffers(1, &buffers.VBO);
+    glGenBuffers(1, &buffers.EBO);
+    buffers.boxMin = boxMin;
+    buffers.boxMax = boxMax;
+
+    glBindVertexArray(buffers.VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, buffers.VBO);
+    glBufferData(GL_ARRAY_BUFFER, vertexCount * sizeof(PackedVertex), vertices, GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers.EBO);
+    buffers.indexCount = (GLsizei)indices.size();
+    size_t indexSize;
+    if (vertexCount <= 65536)
+    {
+        std::vector<uint16_t> shortIndices(indices.begin(), indices.end());
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, shortIndices.size() * sizeof(uint16_t), shortIndices.data(), GL_STATIC_DRAW);
+        buffers.indexType = GL_UNSIGNED_SHORT;
+        indexSize = sizeof(uint16_t);
+    }
+    else
+    {
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint32_t), indices.data(), GL_STATIC_DRAW);
+        buffers.indexType = GL_UNSIGNED_INT;
+        indexSize = sizeof(uint32_t);
+    }
+
+    glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(PackedVertex), (void *)offsetof(PackedVertex, position));
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, sizeof(PackedVertex), (void *)offsetof(PackedVertex, normal));
+    glEnableVertexAttribArray(1);
+
+    glBindVertexArray(0);
+
+    std::cout << "Mesh upload: " << vertexCount * sizeof(PackedVertex) + indices.size() * indexSize << " bytes (float layout "
+              << indices.size() * 6 * sizeof(float) << " bytes)\n";
+}
+
+void drawPackedMesh(const PackedMeshBuffers &buffers)
+{
+    glBindVertexArray(buffers.VAO);
+    glDrawElements(GL_TRIANGLES, buffers.indexCount, buffers.indexType, (void *)0);
+    glBindVertexArray(0);
+}
+
+// Native mesh file. The header is followed by the packed vertices exactly as
+// they are uploaded, so a mapped file can go straight to glBufferData, and
+// then by the index buffer as zigzag-encoded deltas in LEB128 varints.
+struct MeshFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    int32_t field;
+    float isovalue;
+    float gridMin;
+    float gridMax;
+    float stepSize;
+    float boxMin;
+    float boxMax;
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    uint64_t indexBytes;
+};
+
+const char meshFileMagic[8] = {'M', 'C', 'M', 'E', 'S', 'H', '\0', '\0'};
+const uint32_t meshFileVersion = 1;
+
+void encodeIndices(const std::vector<uint32_t> &indices, std::vector<uint8_t> &out)
+{
+    out.clear();
+    int64_t previous = 0;
+    for (uint32_t index : indices)
+    {
+        int64_t delta = (int64_t)index - previous;
+        previous = index;
+        uint64_t zigzag = (uint64_t)((delta << 1) ^ (delta >> 63));
+        do
+        {
+            uint8_t byte = zigzag & 0x7f;
+            zigzag >>= 7;
+            out.push_back(zigzag ? (byte | 0x80) : byte);
+        } while (zigzag);
+    }
+}
+
+bool decodeIndices(const uint8_t *data, size_t size, uint32_t count, std::vector<uint32_t> &indices)
+{
+    // Every index takes at least one byte, so a larger count cannot be valid;
+    // check before sizing the output from it.
+    if (count > size)
+        return false;
+    indices.resize(count);
+    const uint8_t *end = data + size;
+    int64_t previous = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint64_t zigzag = 0;
+        int shift = 0;
+        uint8_t byte;
+        do
+        {
+            if (data == end || shift > 63)
+                return false;
+            byte = *data++;
+            zigzag |= (uint64_t)(byte & 0x7f) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        int64_t delta = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+        previous += delta;
+        indices[i] = (uint32_t)previous;
+    }
+    return true;
+}
+
+bool writeMeshFile(const PackedMesh &mesh, int field, float isovalue, float gridMin, float gridMax, float stepSize, const std::string &fileName)
+{
+    std::ofstream ofs(fileName, std::ios::binary);
+    if (!ofs)
+    {
+        std::cerr << "Cannot open file " << fileName << " for writing.\n";
+        return false;
+    }
+    std::vector<uint8_t> encoded;
+    encodeIndices(mesh.indices, encoded);
+
+    MeshFileHeader header;
+    std::copy(meshFileMagic, meshFileMagic + 8, header.magic);
+    header.version = meshFileVersion;
+    header.field = field;
+    header.isovalue = isovalue;
+    header.gridMin = gridMin;
+    header.gridMax = gridMax;
+    header.stepSize = stepSize;
+    header.boxMin = mesh.boxMin;
+    header.boxMax = mesh.boxMax;
+    header.vertexCount = (uint32_t)mesh.vertices.size();
+    header.indexCount = (uint32_t)mesh.indices.size();
+    header.indexBytes = encoded.size();
+    ofs.write((const char *)&header, sizeof(header));
+    ofs.write((const char *)mesh.vertices.data(), mesh.vertices.size() * sizeof(PackedVertex));
+    ofs.write((const char *)encoded.data(), encoded.size());
+    if (!ofs)
+    {
+        std::cerr << "Failed writing mesh file " << fileName << "\n";
+        return false;
+    }
+    MC_COUNT(CounterBytesWritten, ofs.tellp());
+    std::cout << "Mesh file written: " << fileName << " (" << sizeof(header) + mesh.vertices.size() * sizeof(PackedVertex) + encoded.size() << " bytes)\n";
+    return true;
+}
+
+// Read-only memory mapping of a whole file.
+class MappedFile
+{
+public:
+    ~MappedFile() { close(); }
+
+    bool open(const std::string &fileName)
+    {
+#ifdef _WIN32
+        file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+            return false;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping)
+            return false;
+        bytes = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        length = (size_t)fileSize.QuadPart;
+#else
+        fd = ::open(fileName.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0)
+            return false;
+        bytes = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (bytes == MAP_FAILED)
+        {
+            bytes = nullptr;
+            return false;
+        }
+        length = (size_t)st.st_size;
+#endif
+        return bytes != nullptr;
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+        if (bytes)
+            UnmapViewOfFile(bytes);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (bytes)
+            munmap(bytes, length);
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+#endif
+        bytes = nullptr;
+        length = 0;
+    }
+
+    const uint8_t *data() const { return (const uint8_t *)bytes; }
+    size_t size() const { return length; }
+
+private:
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+    void *bytes = nullptr;
+    size_t length = 0;
+};
+
+// Validates a mapped mesh file and decodes its index buffer. The returned
+// vertex pointer points into the mapping.
+bool readMeshFile(const MappedFile &file, MeshFileHeader &header, const PackedVertex *&vertices, std::vector<uint32_t> &indices)
+{
+    if (file.size() < sizeof(header))
+        return false;
+    std::copy(file.data(), file.data() + sizeof(header), (uint8_t *)&header);
+    if (!std::equal(meshFileMagic, meshFileMagic + 8, header.magic) || header.version != meshFileVersion)
+        return false;
+    size_t vertexBytes = (size_t)header.vertexCount * sizeof(PackedVertex);
+    if (file.size() < sizeof(header) + vertexBytes || file.size() - sizeof(header) - vertexBytes < header.indexBytes)
+        return false;
+    if (header.indexCount % 3 != 0 || header.indexCount > header.indexBytes)
+        return false;
+    vertices = (const PackedVertex *)(file.data() + sizeof(header));
+    if (!decodeIndices(file.data() + sizeof(header) + vertexBytes, header.indexBytes, header.indexCount, indices))
+        return false;
+    for (uint32_t index : indices)
+    {
+        if (index >= header.vertexCount)
+            return false;
+    }
+    return true;
+}
+
+GLuint createLineVAO(const std::vector<float> &lineData)
+{
+    GLuint VAO, VBO;
+    glGenVertexArrays(1, &VAO);
+    glGenBuffers(1, &VBO);
+
+    glBindVertexArray(VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, VBO);
+    glBufferData(GL_ARRAY_BUFFER, lineData.size() * sizeof(float), lineData.data(), GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void *)0);
+    glEnableVertexAttribArray(0);
+    glBindVertexArray(0);
+    return VAO;
+}
+
+// Sculpting. The field is sampled once onto the lattice and brush edits are
+// applied to the samples. The mesh is kept per chunk of cells, each chunk owning
+// a slot in one shared VBO, so an edit only re-extracts and re-uploads the
+// chunks whose cells touch a changed sample.
+
+struct FieldLattice
+{
+    int numCells = 0;
+    float gridMin = 0.0f;
+    float stepSize = 1.0f;
+    std::vector<float> values;
+
+    float &at(int i, int j, int k)
+    {
+        int points = numCells + 1;
+        return values[((size_t)i * points + j) * points + k];
+    }
+
+    glm::vec3 position(int i, int j, int k) const
+    {
+        return glm::vec3(gridMin + i * stepSize, gridMin + j * stepSize, gridMin + k * stepSize);
+    }
+
+    bool contains(const glm::vec3 &p) const
+    {
+        float extent = numCells * stepSize;
+        for (int a = 0; a < 3; a++)
+        {
+            if (p[a] < gridMin || p[a] > gridMin + extent)
+                return false;
+        }
+        return true;
+    }
+
+    // Trilinear interpolation of the samples. Points outside the lattice take
+    // the value at the nearest face rather than extrapolating.
+    float sample(const glm::vec3 &p)
+    {
+        glm::vec3 g = (p - glm::vec3(gridMin)) / stepSize;
+        int c[3];
+        float t[3];
+        for (int a = 0; a < 3; a++)
+        {
+            c[a] = std::min((int)std::floor(g[a]), numCells - 1);
+            c[a] = std::max(c[a], 0);
+            t[a] = std::min(std::max(g[a] - c[a], 0.0f), 1.0f);
+        }
+        float result = 0.0f;
+        for (int corner = 0; corner < 8; corner++)
+        {
+            int dx = corner & 1, dy = (corner >> 1) & 1, dz = (corner >> 2) & 1;
+            float w = (dx ? t[0] : 1.0f - t[0]) * (dy ? t[1] : 1.0f - t[1]) * (dz ? t[2] : 1.0f - t[2]);
+            result += w * at(c[0] + dx, c[1] + dy, c[2] + dz);
+        }
+        return result;
+    }
+};
+
+FieldLattice sampleLattice(std::function<float(float, float, float)> f, float gridMin, float gridMax, float stepSize)
+{
+    FieldLattice lattice;
+    lattice.numCells = latticeCellCount(gridMin, gridMax, stepSize);
+    lattice.gridMin = gridMin;
+    lattice.stepSize = stepSize;
+    int points = lattice.numCells + 1;
+    lattice.values.resize((size_t)points * points * points);
+    for (int i = 0; i < points; i++)
+    {
+        for (int j = 0; j < points; j++)
+        {
+            for (int k = 0; k < points; k++)
+            {
+                glm::vec3 p = lattice.position(i, j, k);
+                lattice.at(i, j, k) = f(p.x, p.y, p.z);
+            }
+        }
+    }
+    return lattice;
+}
+
+struct MeshChunk
+{
+    int begin[3];
+    int end[3];
+    std::vector<float> interleaved;
+    bool dirty = true;
+    GLint first = 0;
+    GLsizei capacity = 0;
+};
+
+struct ChunkedMesh
+{
+    FieldLattice field;
+    float isovalue = 0.0f;
+    int chunkSize = 8;
+    int chunksPerAxis = 0;
+    std::vector<MeshChunk> chunks;
+    GLuint VAO = 0;
+    GLuint VBO = 0;
+    GLsizei capacity = 0; // vertices the VBO holds
+    GLsizei used = 0;     // vertices assigned to chunk slots
+    std::vector<GLint> firsts;
+    std::vector<GLsizei> counts;
+};
+
+// Same triangles and face normals as marchingCubes() + computeNormals(), but
+// read from the lattice samples and written interleaved for upload.
+void extractChunk(FieldLattice &field, float isovalue, MeshChunk &chunk)
+{
+    MC_PROFILE_SCOPE(StageExtraction);
+    chunk.interleaved.clear();
+    size_t activeCells = 0;
+    for (int i = chunk.begin[0]; i < chunk.end[0]; i++)
+    {
+        for (int j = chunk.begin[1]; j < chunk.end[1]; j++)
+        {
+            for (int k = chunk.begin[2]; k < chunk.end[2]; k++)
+            {
+                float cubeValues[8];
+                glm::vec3 cubeVerts[8];
+                int cubeIndex = 0;
+                for (int c = 0; c < 8; c++)
+                {
+                    int ci = i + cornerOffset[c][0], cj = j + cornerOffset[c][1], ck = k + cornerOffset[c][2];
+                    cubeVerts[c] = field.position(ci, cj, ck);
+                    cubeValues[c] = field.at(ci, cj, ck);
+                    if (cubeValues[c] < isovalue)
+                        cubeIndex |= (1 << c);
+                }
+                activeCells += marching_cubes_lut[cubeIndex][0] != -1;
+                for (int t = 0; marching_cubes_lut[cubeIndex][t] != -1; t += 3)
+                {
+                    glm::vec3 triVerts[3];
+                    for (int v = 0; v < 3; v++)
+                    {
+                        int edge = marching_cubes_lut[cubeIndex][t + v];
+                        int v1 = edgeIndex[edge][0];
+                        int v2 = edgeIndex[edge][1];
+                        triVerts[v] = vertexInterp(isovalue, cubeVerts[v1], cubeVerts[v2], cubeValues[v1], cubeValues[v2]);
+                    }
+                    glm::vec3 n = glm::normalize(glm::cross(triVerts[1] - triVerts[0], triVerts[2] - triVerts[0]));
+                    for (int v = 0; v < 3; v++)
+                    {
+                        chunk.interleaved.insert(chunk.interleaved.end(), {triVerts[v].x, triVerts[v].y, triVerts[v].z, n.x, n.y, n.z});
+                    }
+                }
+            }
+        }
+    }
+    MC_COUNT(CounterCellsVisited, (size_t)(chunk.end[0] - chunk.begin[0]) * (chunk.end[1] - chunk.begin[1]) * (chunk.end[2] - chunk.begin[2]));
+    MC_COUNT(CounterActiveCells, activeCells);
+    MC_COUNT(CounterTriangles, chunk.interleaved.size() / 18);
+    chunk.dirty = false;
+}
+
+GLsizei chunkVertexCount(const MeshChunk &chunk)
+{
+    return (GLsizei)(chunk.interleaved.size() / 6);
+}
+
+// Slot size for a chunk of count vertices. Empty chunks get no slack, so
+// headroom scales with the surface rather than with the chunk count.
+GLsizei chunkSlotSize(GLsizei count)
+{
+    return count > 0 ? count + count / 2 + 3 * 64 : 0;
+}
+
+void bindChunkAttributes(ChunkedMesh &mesh)
+{
+    glBindVertexArray(mesh.VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.VBO);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void *)0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void *)(3 * sizeof(float)));
+    glEnableVertexAttribArray(1);
+    glBindVertexArray(0);
+}
+
+// Assigns every chunk a slot with headroom for growth and uploads the whole
+// buffer. Only needed when the mesh is created.
+void layoutChunkBuffer(ChunkedMesh &mesh)
+{
+    MC_PROFILE_SCOPE(StageGLUpload);
+    GLint first = 0;
+    for (MeshChunk &chunk : mesh.chunks)
+    {
+        chunk.first = first;
+        chunk.capacity = chunkSlotSize(chunkVertexCount(chunk));
+        first += chunk.capacity;
+    }
+    mesh.capacity = first;
+    mesh.used = first;
+
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.VBO);
+    glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)mesh.capacity * 6 * sizeof(float), nullptr, GL_DYNAMIC_DRAW);
+    for (size_t c = 0; c < mesh.chunks.size(); c++)
+    {
+        const MeshChunk &chunk = mesh.chunks[c];
+        glBufferSubData(GL_ARRAY_BUFFER, (GLintptr)chunk.first * 6 * sizeof(float), chunk.interleaved.size() * sizeof(float), chunk.interleaved.data());
+        mesh.firsts[c] = chunk.first;
+        mesh.counts[c] = chunkVertexCount(chunk);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Gives a chunk that outgrew its slot a new one at the end of the buffer; the
+// old slot is left unused. When the buffer is full it grows geometrically and
+// the existing slots are copied on the GPU, so an overflow costs one chunk
+// upload rather than a re-upload of the whole mesh.
+void relocateChunk(ChunkedMesh &mesh, MeshChunk &chunk)
+{
+    GLsizei slot = chunkSlotSize(chunkVertexCount(chunk));
+    if (mesh.used + slot > mesh.capacity)
+    {
+        MC_PROFILE_SCOPE(StageGLUpload);
+        GLsizei capacity = std::max(2 * mesh.capacity, mesh.used + slot);
+        GLuint VBO;
+        glGenBuffers(1, &VBO);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, VBO);
+        glBufferData(GL_COPY_WRITE_BUFFER, (GLsizeiptr)capacity * 6 * sizeof(float), nullptr, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_COPY_READ_BUFFER, mesh.VBO);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, (GLsizeiptr)mesh.used * 6 * sizeof(float));
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        glDeleteBuffers(1, &mesh.VBO);
+        mesh.VBO = VBO;
+        mesh.capacity = capacity;
+        bindChunkAttributes(mesh);
+    }
+    chunk.first = mesh.used;
+    chunk.capacity = slot;
+    mesh.used += slot;
+}
+
+void createChunkedMesh(ChunkedMesh &mesh, std::function<float(float, float, float)> f, float isovalue, float gridMin, float gridMax, float stepSize)
+{
+    mesh.field = sampleLattice(f, gridMin, gridMax, stepSize);
+    mesh.isovalue = isovalue;
+    int numCells = mesh.field.numCells;
+    mesh.chunksPerAxis = (numCells + mesh.chunkSize - 1) / mesh.chunkSize;
+    mesh.chunks.clear();
+    for (int cx = 0; cx < mesh.chunksPerAxis; cx++)
+    {
+        for (int cy = 0; cy < mesh.chunksPerAxis; cy++)
+        {
+            for (int cz = 0; cz < mesh.chunksPerAxis; cz++)
+            {
+                MeshChunk chunk;
+                int c[3] = {cx, cy, cz};
+                for (int a = 0; a < 3; a++)
+                {
+                    chunk.begin[a] = c[a] * mesh.chunkSize;
+                    chunk.end[a] = std::min(chunk.begin[a] + mesh.chunkSize, numCells);
+                }
+                extractChunk(mesh.field, isovalue, chunk);
+                mesh.chunks.push_back(std::move(chunk));
+            }
+        }
+    }
+    mesh.firsts.resize(mesh.chunks.size());
+    mesh.counts.resize(mesh.chunks.size());
+
+    glGenVertexArrays(1, &mesh.VAO);
+    glGenBuffers(1, &mesh.VBO);
+    layoutChunkBuffer(mesh);
+    bindChunkAttributes(mesh);
+}
+
+// Adds (union) or carves (difference) a sphere into the sampled field and marks
+// every chunk containing a cell that touches a changed sample as dirty.
+void applyBrush(ChunkedMesh &mesh, const glm::vec3 &center, float radius, bool add)
+{
+    FieldLattice &field = mesh.field;
+    int lo[3], hi[3];
+    for (int a = 0; a < 3; a++)
+    {
+        lo[a] = std::max((int)std::floor((center[a] - radius - field.gridMin) / field.stepSize), 0);
+        hi[a] = std::min((int)std::ceil((center[a] + radius - field.gridMin) / field.stepSize), field.numCells);
+        if (lo[a] > hi[a])
+            return;
+    }
+    for (int i = lo[0]; i <= hi[0]; i++)
+    {
+        for (int j = lo[1]; j <= hi[1]; j++)
+        {
+            for (int k = lo[2]; k <= hi[2]; k++)
+            {
+                float d = glm::length(field.position(i, j, k) - center);
+                float &value = field.at(i, j, k);
+                if (add)
+                    value = std::min(value, mesh.isovalue + d - radius);
+                else
+                    value = std::max(value, mesh.isovalue + radius - d);
+            }
+        }
+    }
+
+    // A sample is a corner of the cells on either side of it, hence the
+    // one-cell apron below the changed range.
+    int chunkLo[3], chunkHi[3];
+    for (int a = 0; a < 3; a++)
+    {
+        int cellLo = std::max(lo[a] - 1, 0);
+        int cellHi = std::min(hi[a], field.numCells - 1);
+        chunkLo[a] = cellLo / mesh.chunkSize;
+        chunkHi[a] = cellHi / mesh.chunkSize;
+    }
+    for (int cx = chunkLo[0]; cx <= chunkHi[0]; cx++)
+    {
+        for (int cy = chunkLo[1]; cy <= chunkHi[1]; cy++)
+        {
+            for (int cz = chunkLo[2]; cz <= chunkHi[2]; cz++)
+            {
+                mesh.chunks[((size_t)cx * mesh.chunksPerAxis + cy) * mesh.chunksPerAxis + cz].dirty = true;
+            }
+        }
+    }
+}
+
+// Re-extracts dirty chunks and rewrites only their VBO slots. Returns the
+// number of chunks updated.
+int updateDirtyChunks(ChunkedMesh &mesh)
+{
+    int updated = 0;
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.VBO);
+    for (size_t c = 0; c < mesh.chunks.size(); c++)
+    {
+        MeshChunk &chunk = mesh.chunks[c];
+        if (!chunk.dirty)
+            continue;
+        extractChunk(mesh.field, mesh.isovalue, chunk);
+        updated++;
+        if (chunkVertexCount(chunk) > chunk.capacity)
+        {
+            relocateChunk(mesh, chunk);
+            mesh.firsts[c] = chunk.first;
+            glBindBuffer(GL_ARRAY_BUFFER, mesh.VBO);
+        }
+        {
+            MC_PROFILE_SCOPE(StageGLUpload);
+            glBufferSubData(GL_ARRAY_BUFFER, (GLintptr)chunk.first * 6 * sizeof(float), chunk.interleaved.size() * sizeof(float), chunk.interleaved.data());
+        }
+        mesh.counts[c] = chunkVertexCount(chunk);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return updated;
+}
+
+// A stroke stamps once on press and then whenever the brush has moved half a
+// radius across the view. Movement along the view ray does not count: the ray
+// under a still cursor hits the sphere just stamped, nearer the camera when
+// adding and further away when carving, and stamping again would extrude or
+// tunnel toward the viewer at frame rate.
+bool brushStampDue(bool strokeStamped, const glm::vec3 &lastStamp, const glm::vec3 &hit, const glm::vec3 &cameraPos)
+{
+    if (!strokeStamped)
+        return true;
+    glm::vec3 viewDir = glm::normalize(hit - cameraPos);
+    glm::vec3 moved = hit - lastStamp;
+    glm::vec3 across = moved - glm::dot(moved, viewDir) * viewDir;
+    return glm::length(across) >= 0.5f * brushRadius;
+}
+
+void drawChunkedMesh(const ChunkedMesh &mesh)
+{
+    glBindVertexArray(mesh.VAO);
+    glMultiDrawArrays(GL_TRIANGLES, mesh.firsts.data(), mesh.counts.data(), (GLsizei)mesh.chunks.size());
+    glBindVertexArray(0);
+}
+
+void collectChunkedMesh(const ChunkedMesh &mesh, std::vector<float> &vertices, std::vector<float> &normals)
+{
+    vertices.clear();
+    normals.clear();
+    for (const MeshChunk &chunk : mesh.chunks)
+    {
+        for (size_t i = 0; i < chunk.interleaved.size(); i += 6)
+        {
+            vertices.insert(vertices.end(), &chunk.interleaved[i], &chunk.interleaved[i] + 3);
+            normals.insert(normals.end(), &chunk.interleaved[i + 3], &chunk.interleaved[i + 3] + 3);
+        }
+    }
+}
+
+// Marches the ray under the cursor through the sampled field and returns the
+// first isosurface crossing.
+bool pickSurface(GLFWwindow *window, ChunkedMesh &mesh, double xpos, double ypos, glm::vec3 &hit)
+{
+    int width, height;
+    glfwGetWindowSize(window, &width, &height);
+    if (width <= 0 || height <= 0)
+        return false;
+    glm::vec3 cameraPos = computeCameraPos();
+    glm::mat4 V = glm::lookAt(cameraPos, glm::vec3(0, 0, 0), glm::vec3(0, 1, 0));
+    glm::mat4 inverseVP = glm::inverse(projection * V);
+    float ndcX = 2.0f * float(xpos) / width - 1.0f;
+    float ndcY = 1.0f - 2.0f * float(ypos) / height;
+    glm::vec4 farPoint = inverseVP * glm::vec4(ndcX, ndcY, 1.0f, 1.0f);
+    glm::vec3 dir = glm::normalize(glm::vec3(farPoint) / farPoint.w - cameraPos);
+
+    float step = mesh.field.stepSize * 0.25f;
+    bool havePrev = false;
+    float prevValue = 0.0f;
+    for (float t = 0.0f; t < 100.0f; t += step)
+    {
+        glm::vec3 p = cameraPos + t * dir;
+        if (!mesh.field.contains(p))
+        {
+            havePrev = false;
+            continue;
+        }
+        float value = mesh.field.sample(p) - mesh.isovalue;
+        if (havePrev && (value < 0.0f) != (prevValue < 0.0f))
+        {
+            float mu = prevValue / (prevValue - value);
+            hit = cameraPos + (t - step + mu * step) * dir;
+            return true;
+        }
+        prevValue = value;
+        havePrev = true;
+    }
+    return false;
+}
+
+// Playback of time-varying fields. Worker threads extract frames ahead of the
+// playhead into a bounded set of ready meshes; the render loop picks up the
+// newest ready frame that is due without waiting on extraction. Frames that
+// fall behind the playhead are dropped instead of being extracted late.
+// Every worker extracts into its own ExtractionContext, and frame buffers go
+// back to a free list once uploaded, so steady playback does not allocate.
+
+struct MeshFrame
+{
+    int index = 0;
+    std::vector<float> interleaved;
+};
+
+class FramePipeline
+{
+public:
+    FramePipeline(std::function<void(ExtractionContext &, int, std::vector<float> &)> extract, int capacity, int numWorkers)
+        : extractFrame(extract), capacity(capacity)
+    {
+        ready.reserve(capacity);
+        freeBuffers.reserve(capacity + numWorkers + 1);
+        for (int i = 0; i < numWorkers; i++)
+            workers.emplace_back(&FramePipeline::run, this);
+    }
+
+    ~FramePipeline()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        spaceAvailable.notify_all();
+        for (std::thread &worker : workers)
+            worker.join();
+    }
+
+    // Moves the newest ready frame not later than playhead into frame and
+    // discards older ones. Returns false if no such frame is ready yet.
+    bool acquire(int playhead, MeshFrame &frame)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->playhead = playhead;
+        int best = -1;
+        for (int i = 0; i < (int)ready.size(); i++)
+        {
+            if (ready[i].index <= playhead && (best < 0 || ready[i].index > ready[best].index))
+                best = i;
+        }
+        if (best < 0)
+            return false;
+        int bestIndex = ready[best].index;
+        frame = std::move(ready[best]);
+        for (int i = (int)ready.size() - 1; i >= 0; i--)
+        {
+            if (ready[i].index <= bestIndex)
+            {
+                if (ready[i].index < bestIndex)
+                {
+                    droppedFrames++;
+                    freeBuffers.push_back(std::move(ready[i].interleaved));
+                }
+                ready.erase(ready.begin() + i);
+            }
+        }
+        spaceAvailable.notify_all();
+        return true;
+    }
+
+    // Hands the buffer of a frame that has been uploaded back to the workers.
+    void release(MeshFrame &frame)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        freeBuffers.push_back(std::move(frame.interleaved));
+    }
+
+    std::atomic<int> extractedFrames{0};
+    std::atomic<int> droppedFrames{0};
+
+private:
+    void run()
+    {
+        ExtractionContext context;
+        std::vector<float> scratch;
+        while (true)
+        {
+            int index;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                spaceAvailable.wait(lock, [this]()
+                                    { return stopping || (int)ready.size() + inFlight < capacity; });
+                if (stopping)
+                    return;
+                // Drop-frame policy: never start on a frame the playhead has passed.
+                if (nextFrame < playhead)
+                {
+                    droppedFrames += playhead - nextFrame;
+                    nextFrame = playhead;
+                }
+                index = nextFrame++;
+                inFlight++;
+                if (!freeBuffers.empty())
+                {
+                    scratch.swap(freeBuffers.back());
+                    freeBuffers.pop_back();
+                }
+            }
 
-std::vector<float> computeNormals(const std::vector<float> &vertices)
-{
-    std::vector<float> normals;
-    for (size_t i = 0; i < vertices.size(); i += 9)
-    {
-        glm::vec3 p0(vertices[i], vertices[i + 1], vertices[i + 2]);
-        glm::vec3 p1(vertices[i + 3], vertices[i + 4], vertices[i + 5]);
-        glm::vec3 p2(vertices[i + 6], vertices[i + 7], vertices[i + 8]);
-        glm::vec3 edge1 = p1 - p0;
-        glm::vec3 edge2 = p2 - p0;
-        glm::vec3 n = glm::normalize(glm::cross(edge1, edge2));
-        for (int j = 0; j < 3; j++)
-        {
-            normals.push_back(n.x);
-            normals.push_back(n.y);
-            normals.push_back(n.z);
+            extractFrame(context, index, scratch);
+            extractedFrames++;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                inFlight--;
+                MeshFrame frame;
+                frame.index = index;
+                frame.interleaved.swap(scratch);
+                ready.push_back(std::move(frame));
+            }
         }
     }
-    return normals;
-}
 
-void writePLY(const std::vector<float> &vertices, const std::vector<float> &normals, const std::string &fileName)
+    std::function<void(ExtractionContext &, int, std::vector<float> &)> extractFrame;
+    int capacity;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable spaceAvailable;
+    std::vector<MeshFrame> ready;
+    std::vector<std::vector<float>> freeBuffers;
+    int inFlight = 0;
+    int nextFrame = 0;
+    int playhead = 0;
+    bool stopping = false;
+};
+
+bool selectTimeVaryingField(int fieldChoice, std::function<float(float, float, float, float)> &scalarField, float &isovalue)
 {
-    std::ofstream ofs(fileName);
-    if (!ofs)
+    if (fieldChoice == 1)
     {
-        std::cerr << "Cannot open file " << fileName << " for writing.\n";
-        return;
+        scalarField = [](float x, float y, float z, float t) -> float
+        {
+            return y - sin(x + t) * cos(z - 0.5f * t);
+        };
+        isovalue = 0.0f;
     }
-    int numVertices = vertices.size() / 3;
-    int numFaces = numVertices / 3;
-    ofs << "ply\nformat ascii 1.0\n";
-    ofs << "element vertex " << numVertices << "\n";
-    ofs << "property float x\nproperty float y\nproperty float z\n";
-    ofs << "property float nx\nproperty float ny\nproperty float nz\n";
-    ofs << "element face " << numFaces << "\n";
-    ofs << "property list uchar int vertex_indices\n";
-    ofs << "end_header\n";
-    for (int i = 0; i < numVertices; i++)
+    else if (fieldChoice == 2)
     {
-        ofs << vertices[3 * i] << " " << vertices[3 * i + 1] << " " << vertices[3 * i + 2] << " ";
-        ofs << normals[3 * i] << " " << normals[3 * i + 1] << " " << normals[3 * i + 2] << "\n";
+        scalarField = [](float x, float y, float z, float t) -> float
+        {
+            return x * x - y * y - z * z - z * (1.0f + 0.5f * sin(t));
+        };
+        isovalue = -1.5f;
     }
-    for (int i = 0; i < numFaces; i++)
+    else
     {
-        ofs << "3 " << 3 * i << " " << 3 * i + 1 << " " << 3 * i + 2 << "\n";
+        std::cerr << "Invalid field choice. Use 1 or 2." << std::endl;
+        return false;
     }
-    ofs.close();
-    std::cout << "PLY file written: " << fileName << "\n";
+    return true;
 }
 
-GLuint compileShader(const char *vertexSource, const char *fragmentSource)
+// Loads a cubic volume of raw 32-bit floats spanning [gridMin, gridMax]^3.
+bool loadVolume(const std::string &fileName, float gridMin, float gridMax, FieldLattice &lattice)
 {
-    GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertexShader, 1, &vertexSource, nullptr);
-    glCompileShader(vertexShader);
-    GLint success;
-    glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &success);
-    if (!success)
+    std::ifstream ifs(fileName, std::ios::binary | std::ios::ate);
+    if (!ifs)
     {
-        char infoLog[512];
-        glGetShaderInfoLog(vertexShader, 512, nullptr, infoLog);
-        std::cerr << "Vertex shader compilation failed:\n"
-                  << infoLog << "\n";
+        std::cerr << "Cannot open volume file " << fileName << "\n";
+        return false;
     }
-
-    GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragmentShader, 1, &fragmentSource, nullptr);
-    glCompileShader(fragmentShader);
-    glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &success);
-    if (!success)
+    size_t count = (size_t)ifs.tellg() / sizeof(float);
+    int points = (int)std::lround(std::cbrt((double)count));
+    if (points < 2 || (size_t)points * points * points != count)
     {
-        char infoLog[512];
-        glGetShaderInfoLog(fragmentShader, 512, nullptr, infoLog);
-        std::cerr << "Fragment shader compilation failed:\n"
-                  << infoLog << "\n";
+        std::cerr << fileName << " is not a cubic volume of floats.\n";
+        return false;
     }
-
-    GLuint shaderProgram = glCreateProgram();
-    glAttachShader(shaderProgram, vertexShader);
-    glAttachShader(shaderProgram, fragmentShader);
-    glLinkProgram(shaderProgram);
-    glGetProgramiv(shaderProgram, GL_LINK_STATUS, &success);
-    if (!success)
+    lattice.numCells = points - 1;
+    lattice.gridMin = gridMin;
+    lattice.stepSize = (gridMax - gridMin) / lattice.numCells;
+    lattice.values.resize(count);
+    ifs.seekg(0);
+    ifs.read((char *)lattice.values.data(), count * sizeof(float));
+    if (!ifs)
     {
-        char infoLog[512];
-        glGetProgramInfoLog(shaderProgram, 512, nullptr, infoLog);
-        std::cerr << "Shader linking failed:\n"
-                  << infoLog << "\n";
+        std::cerr << "Failed reading volume file " << fileName << "\n";
+        return false;
     }
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader);
-    return shaderProgram;
+    return true;
 }
 
-void createMeshBuffers(GLuint &VAO, GLuint &VBO, const std::vector<float> &vertices, const std::vector<float> &normals)
+// Double-buffered VBOs so a new frame is uploaded while the previous one may
+// still be in use by the GPU.
+struct PlaybackBuffers
 {
-    std::vector<float> interleaved;
-    int numVerts = vertices.size() / 3;
-    for (int i = 0; i < numVerts; i++)
+    GLuint VAO[2] = {0, 0};
+    GLuint VBO[2] = {0, 0};
+    GLsizei vertexCount = 0;
+    int front = 0;
+};
+
+void createPlaybackBuffers(PlaybackBuffers &buffers)
+{
+    glGenVertexArrays(2, buffers.VAO);
+    glGenBuffers(2, buffers.VBO);
+    for (int i = 0; i < 2; i++)
     {
-        interleaved.push_back(vertices[3 * i]);
-        interleaved.push_back(vertices[3 * i + 1]);
-        interleaved.push_back(vertices[3 * i + 2]);
-        interleaved.push_back(normals[3 * i]);
-        interleaved.push_back(normals[3 * i + 1]);
-        interleaved.push_back(normals[3 * i + 2]);
+        glBindVertexArray(buffers.VAO[i]);
+        glBindBuffer(GL_ARRAY_BUFFER, buffers.VBO[i]);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void *)0);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void *)(3 * sizeof(float)));
+        glEnableVertexAttribArray(1);
     }
+    glBindVertexArray(0);
+}
 
-    glGenVertexArrays(1, &VAO);
-    glGenBuffers(1, &VBO);
-
-    glBindVertexArray(VAO);
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, interleaved.size() * sizeof(float), interleaved.data(), GL_STATIC_DRAW);
-
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void *)0);
-    glEnableVertexAttribArray(0);
-
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void *)(3 * sizeof(float)));
-    glEnableVertexAttribArray(1);
+void uploadPlaybackFrame(PlaybackBuffers &buffers, const MeshFrame &frame)
+{
+    MC_PROFILE_SCOPE(StageGLUpload);
+    int back = 1 - buffers.front;
+    glBindBuffer(GL_ARRAY_BUFFER, buffers.VBO[back]);
+    glBufferData(GL_ARRAY_BUFFER, frame.interleaved.size() * sizeof(float), frame.interleaved.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    buffers.front = back;
+    buffers.vertexCount = (GLsizei)(frame.interleaved.size() / 6);
+}
 
+void drawPlaybackBuffers(const PlaybackBuffers &buffers)
+{
+    glBindVertexArray(buffers.VAO[buffers.front]);
+    glDrawArrays(GL_TRIANGLES, 0, buffers.vertexCount);
     glBindVertexArray(0);
 }
 
-GLuint createLineVAO(const std::vector<float> &lineData)
+#ifdef MC_PROFILE
+// Overlay with the frame time and the profiler totals, drawn with GLUT bitmap
+// fonts through the compatibility profile.
+void drawProfilerHud(GLFWwindow *window, double frameMs)
 {
-    GLuint VAO, VBO;
-    glGenVertexArrays(1, &VAO);
-    glGenBuffers(1, &VBO);
+    int width, height;
+    glfwGetFramebufferSize(window, &width, &height);
+    std::vector<std::string> lines = profilerSummaryLines();
+    lines.insert(lines.begin(), "frame time: " + std::to_string(frameMs) + " ms");
+
+    glUseProgram(0);
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho(0, width, height, 0, -1, 1);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+    glDisable(GL_DEPTH_TEST);
+    glColor3f(1.0f, 1.0f, 0.6f);
+    for (size_t i = 0; i < lines.size(); i++)
+    {
+        glRasterPos2i(10, 20 + 15 * (int)i);
+        glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char *)lines[i].c_str());
+    }
+    glEnable(GL_DEPTH_TEST);
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+}
+#endif
 
-    glBindVertexArray(VAO);
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, lineData.size() * sizeof(float), lineData.data(), GL_STATIC_DRAW);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void *)0);
-    glEnableVertexAttribArray(0);
-    glBindVertexArray(0);
-    return VAO;
+// Per-frame matrices shared by both shader programs through a uniform buffer
+// bound at frameUniformsBinding. Layout matches the std140 block below.
+struct FrameUniforms
+{
+    glm::mat4 MVP;
+    glm::mat4 V;
+    glm::vec4 cameraPos;
+};
+
+const GLuint frameUniformsBinding = 0;
+
+GLuint createFrameUniformBuffer(std::initializer_list<GLuint> programs)
+{
+    for (GLuint program : programs)
+    {
+        GLuint blockIndex = glGetUniformBlockIndex(program, "FrameUniforms");
+        if (blockIndex != GL_INVALID_INDEX)
+            glUniformBlockBinding(program, blockIndex, frameUniformsBinding);
+    }
+    GLuint UBO;
+    glGenBuffers(1, &UBO);
+    glBindBuffer(GL_UNIFORM_BUFFER, UBO);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, frameUniformsBinding, UBO);
+    return UBO;
 }
 
 const char *lineVertexSource = R"(
 #version 330 core
 layout(location = 0) in vec3 aPos;
-uniform mat4 MVP;
+layout(std140) uniform FrameUniforms {
+    mat4 MVP;
+    mat4 V;
+    vec4 cameraPos;
+};
 void main() {
     gl_Position = MVP * vec4(aPos, 1.0);
 }
@@ -365,13 +1856,165 @@ void main() {
 
 int main(int argc, char **argv)
 {
-    Axes worldaxes(glm::vec3(gridMin, gridMin, gridMin), glm::vec3(gridMax - gridMin, gridMax - gridMin, gridMax - gridMin));
+    int fieldChoice = 1;
+    std::string outputFile = "exercise1.ply";
+    int resolution = 0;
+    int numTiles = 0;
+    int tileIndex = -1;
+    std::string tileFile;
+    std::vector<std::string> mergeFiles;
+    bool mergeOnly = false;
+    bool sculpt = false;
+    bool floatVBO = false;
+    bool continuous = false;
+    std::string saveMeshFile;
+    std::string loadMeshFile;
+    bool animate = false;
+    std::vector<std::string> volumeFiles;
+    float playbackFps = 24.0f;
+    float volumeIsovalue = 0.0f;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--out" && i + 1 < argc)
+        {
+            outputFile = argv[++i];
+        }
+        else if (arg == "--animate")
+        {
+            animate = true;
+        }
+        else if (arg == "--volumes" && i + 1 < argc)
+        {
+            while (i + 1 < argc && std::string(argv[i + 1]).rfind("--", 0) != 0)
+                volumeFiles.push_back(argv[++i]);
+        }
+        else if (arg == "--fps" && i + 1 < argc)
+        {
+            playbackFps = (float)std::atof(argv[++i]);
+        }
+        else if (arg == "--iso" && i + 1 < argc)
+        {
+            volumeIsovalue = (float)std::atof(argv[++i]);
+        }
+        else if (arg == "--save-mesh" && i + 1 < argc)
+        {
+            saveMeshFile = argv[++i];
+        }
+        else if (arg == "--load-mesh" && i + 1 < argc)
+        {
+            loadMeshFile = argv[++i];
+        }
+        else if (arg == "--continuous")
+        {
+            continuous = true;
+        }
+        else if (arg == "--float-vbo")
+        {
+            floatVBO = true;
+        }
+        else if (arg == "--sculpt")
+        {
+            sculpt = true;
+        }
+        else if (arg == "--resolution" && i + 1 < argc)
+        {
+            resolution = std::atoi(argv[++i]);
+            if (resolution <= 0)
+            {
+                std::cerr << "Resolution must be positive.\n";
+                return -1;
+            }
+        }
+        else if (arg == "--tiles" && i + 1 < argc)
+        {
+            numTiles = std::atoi(argv[++i]);
+        }
+        else if (arg == "--tile" && i + 3 < argc)
+        {
+            tileIndex = std::atoi(argv[++i]);
+            numTiles = std::atoi(argv[++i]);
+            tileFile = argv[++i];
+        }
+        else if (arg == "--merge" && i + 1 < argc)
+        {
+            mergeOnly = true;
+            outputFile = argv[++i];
+            while (i + 1 < argc)
+                mergeFiles.push_back(argv[++i]);
+        }
+        else if (arg.rfind("--", 0) == 0)
+        {
+            std::cerr << "Unknown option " << arg << "\n";
+            return -1;
+        }
+        else
+        {
+            fieldChoice = std::atoi(argv[i]);
+        }
+    }
+
+    if (mergeOnly)
+    {
+        return mergeTiles(mergeFiles, outputFile) ? 0 : -1;
+    }
+
+    std::function<float(float, float, float)> scalarField;
+    float isovalue;
+    if (!selectScalarField(fieldChoice, scalarField, isovalue))
+    {
+        return -1;
+    }
+
+    // A saved mesh brings its own grid, so map it before anything is sized
+    // from gridMin and gridMax.
+    MappedFile meshFile;
+    MeshFileHeader meshFileHeader;
+    const PackedVertex *meshFileVertices = nullptr;
+    std::vector<uint32_t> meshFileIndices;
+    if (!loadMeshFile.empty())
+    {
+        auto loadStart = std::chrono::steady_clock::now();
+        if (!meshFile.open(loadMeshFile) || !readMeshFile(meshFile, meshFileHeader, meshFileVertices, meshFileIndices))
+        {
+            std::cerr << "Cannot load mesh file " << loadMeshFile << "\n";
+            return -1;
+        }
+        gridMin = meshFileHeader.gridMin;
+        gridMax = meshFileHeader.gridMax;
+        stepSize = meshFileHeader.stepSize;
+        resolution = 0;
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loadStart).count();
+        std::cout << "Loaded " << loadMeshFile << ": field " << meshFileHeader.field << ", isovalue " << meshFileHeader.isovalue << ", "
+                  << meshFileHeader.vertexCount << " vertices, " << meshFileHeader.indexCount / 3 << " triangles in " << ms << " ms\n";
+    }
+
+    if (resolution > 0)
+    {
+        stepSize = latticeStepSize(gridMin, gridMax, resolution);
+    }
+    else
+    {
+        resolution = (int)std::lround((gridMax - gridMin) / stepSize);
+    }
+
+    if (tileIndex >= 0)
+    {
+        return runTileWorker(scalarField, fieldChoice, isovalue, tileIndex, numTiles, tileFile) ? 0 : -1;
+    }
+    if (numTiles > 0)
+    {
+        return runTiledExtraction(argv[0], fieldChoice, resolution, numTiles, outputFile) ? 0 : -1;
+    }
 
     if (!glfwInit())
     {
         std::cerr << "Failed to initialize GLFW\n";
         return -1;
     }
+#ifdef MC_PROFILE
+    glutInit(&argc, argv);
+#endif
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_COMPAT_PROFILE);
@@ -388,6 +2031,8 @@ int main(int argc, char **argv)
     glfwSetMouseButtonCallback(window, mouse_button_callback);
     glfwSetCursorPosCallback(window, cursor_position_callback);
     glfwSetKeyCallback(window, key_callback);
+    glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+    glfwSetWindowRefreshCallback(window, window_refresh_callback);
 
     glewExperimental = GL_TRUE;
     if (glewInit() != GLEW_OK)
@@ -397,24 +2042,43 @@ int main(int argc, char **argv)
     }
 
     glEnable(GL_DEPTH_TEST);
+    glLineWidth(2.0f);
+    int framebufferWidth, framebufferHeight;
+    glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+    framebuffer_size_callback(window, framebufferWidth, framebufferHeight);
 
     const char *vertexShaderSource = R"(
     #version 330 core
     layout(location = 0) in vec3 aPos;
     layout(location = 1) in vec3 aNormal;
-    uniform mat4 MVP;
-    uniform mat4 V;
+    layout(std140) uniform FrameUniforms {
+        mat4 MVP;
+        mat4 V;
+        vec4 cameraPos;
+    };
     uniform vec3 LightDir;
+    uniform vec3 positionOffset;
+    uniform float positionScale;
+    uniform bool octNormals;
     out vec3 FragPos;
     out vec3 Normal;
     out vec3 LightDirection;
+    vec3 octDecode(vec2 e) {
+        vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+        float t = max(-n.z, 0.0);
+        n.x += n.x >= 0.0 ? -t : t;
+        n.y += n.y >= 0.0 ? -t : t;
+        return normalize(n);
+    }
     void main() {
-        FragPos = aPos;
-        vec4 NormalTest = vec4(aNormal, 0) * V;
+        vec3 position = positionOffset + aPos * positionScale;
+        vec3 normal = octNormals ? octDecode(aNormal.xy) : aNormal;
+        FragPos = position;
+        vec4 NormalTest = vec4(normal, 0) * V;
         Normal = vec3(NormalTest.x, NormalTest.y, NormalTest.z);
         vec4 LightDirectionTest = vec4(LightDir, 1) * V;
         LightDirection = vec3(LightDirectionTest.x, LightDirectionTest.y, LightDirectionTest.z);
-        gl_Position = MVP * vec4(aPos, 1.0);
+        gl_Position = MVP * vec4(position, 1.0);
     }
     )";
 
@@ -423,8 +2087,12 @@ int main(int argc, char **argv)
     in vec3 FragPos;
     in vec3 Normal;
     in vec3 LightDirection;
+    layout(std140) uniform FrameUniforms {
+        mat4 MVP;
+        mat4 V;
+        vec4 cameraPos;
+    };
     uniform vec3 modelColor;
-    uniform vec3 cameraPos;
     out vec4 FragColor;
     void main() {
         vec3 ambient = vec3(0.2);
@@ -432,7 +2100,7 @@ int main(int argc, char **argv)
         vec3 lightDir = normalize(LightDirection);
         float diff = clamp(dot(norm, lightDir), 0.0, 1.0);
         vec3 diffuse = diff * modelColor;
-        vec3 viewDir = normalize(0 - cameraPos);
+        vec3 viewDir = normalize(0 - cameraPos.xyz);
         vec3 reflectDir = reflect(-lightDir, norm);
         float spec = pow(clamp(dot(viewDir, reflectDir), 0, 1), 64);
         vec3 specular = vec3(1.0) * spec;
@@ -444,43 +2112,96 @@ int main(int argc, char **argv)
     GLuint shaderProgram = compileShader(vertexShaderSource, fragmentShaderSource);
     GLuint lineShaderProgram = compileShader(lineVertexSource, lineFragmentSource);
 
-    int fieldChoice = 1;
-    if (argc > 1)
+    bool playback = animate || !volumeFiles.empty();
+    ExtractionContext extraction;
+    std::vector<float> &meshVertices = extraction.vertices;
+    std::vector<float> &meshNormals = extraction.normals;
+    GLuint meshVAO = 0, meshVBO = 0;
+    PackedMeshBuffers packedMesh;
+    if (meshFile.data())
+    {
+        floatVBO = false;
+        uploadPackedMesh(packedMesh, meshFileVertices, meshFileHeader.vertexCount, meshFileIndices, meshFileHeader.boxMin, meshFileHeader.boxMax);
+        meshFile.close();
+    }
+    else if (!playback && !sculpt)
     {
-        fieldChoice = std::atoi(argv[1]);
+        marchingCubes(extraction, scalarField, isovalue, gridMin, gridMax, stepSize);
+        computeNormals(extraction);
+        writePLY(meshVertices, meshNormals, outputFile);
+        PackedMesh packed;
+        if (!floatVBO || !saveMeshFile.empty())
+        {
+            buildPackedMesh(packed, meshVertices, meshNormals, gridMin, gridMax);
+        }
+        if (!saveMeshFile.empty())
+        {
+            writeMeshFile(packed, fieldChoice, isovalue, gridMin, gridMax, stepSize, saveMeshFile);
+        }
+        if (floatVBO)
+        {
+            createMeshBuffers(meshVAO, meshVBO, extraction);
+        }
+        else
+        {
+            uploadPackedMesh(packedMesh, packed.vertices.data(), packed.vertices.size(), packed.indices, packed.boxMin, packed.boxMax);
+        }
     }
+    GLsizei meshVertexCount = meshVertices.size() / 3;
 
-    std::function<float(float, float, float)> scalarField;
-    float isovalue;
-    if (fieldChoice == 1)
+    std::function<float(float, float, float, float)> timeField;
+    std::vector<FieldLattice> volumes;
+    std::function<void(ExtractionContext &, int, std::vector<float> &)> extractFrame;
+    if (!volumeFiles.empty())
     {
-        scalarField = [](float x, float y, float z) -> float
+        volumes.resize(volumeFiles.size());
+        for (size_t i = 0; i < volumeFiles.size(); i++)
         {
-            return y - sin(x) * cos(z);
+            if (!loadVolume(volumeFiles[i], gridMin, gridMax, volumes[i]))
+                return -1;
+        }
+        extractFrame = [&volumes, volumeIsovalue](ExtractionContext &context, int index, std::vector<float> &interleaved)
+        {
+            const FieldLattice &volume = volumes[index % volumes.size()];
+            marchingCubesLattice(context, volume.values.data(), volume.numCells, volume.gridMin, volume.stepSize, volumeIsovalue);
+            computeNormals(context);
+            interleaveMesh(context.vertices, context.normals, interleaved);
         };
-        isovalue = 0.0f;
     }
-    else if (fieldChoice == 2)
+    else if (animate)
     {
-        scalarField = [](float x, float y, float z) -> float
+        if (!selectTimeVaryingField(fieldChoice, timeField, isovalue))
+            return -1;
+        extractFrame = [&timeField, isovalue, playbackFps](ExtractionContext &context, int index, std::vector<float> &interleaved)
         {
-            return x * x - y * y - z * z - z;
+            float t = index / playbackFps;
+            auto f = [&timeField, t](float x, float y, float z)
+            { return timeField(x, y, z, t); };
+            marchingCubes(context, f, isovalue, gridMin, gridMax, stepSize);
+            computeNormals(context);
+            interleaveMesh(context.vertices, context.normals, interleaved);
         };
-        isovalue = -1.5f;
     }
-    else
+
+    std::unique_ptr<FramePipeline> pipeline;
+    PlaybackBuffers playbackBuffers;
+    double playbackStart = 0.0, statsStart = 0.0;
+    int displayedFrames = 0, uploadedFrames = 0, statsExtracted = 0;
+    if (playback)
     {
-        std::cerr << "Invalid field choice. Use 1 or 2." << std::endl;
-        return -1;
+        int numWorkers = std::max((int)std::thread::hardware_concurrency() - 1, 1);
+        createPlaybackBuffers(playbackBuffers);
+        pipeline.reset(new FramePipeline(extractFrame, std::max(4, 2 * numWorkers), numWorkers));
+        playbackStart = statsStart = glfwGetTime();
     }
 
-    std::vector<float> meshVertices = marchingCubes(scalarField, isovalue, gridMin, gridMax, stepSize);
-    std::vector<float> meshNormals = computeNormals(meshVertices);
-    writePLY(meshVertices, meshNormals, "exercise1.ply");
-
-    GLuint meshVAO, meshVBO;
-    createMeshBuffers(meshVAO, meshVBO, meshVertices, meshNormals);
-    GLsizei meshVertexCount = meshVertices.size() / 3;
+    ChunkedMesh sculptMesh;
+    bool strokeStamped = false;
+    glm::vec3 lastStamp(0.0f);
+    if (sculpt)
+    {
+        createChunkedMesh(sculptMesh, scalarField, isovalue, gridMin, gridMax, stepSize);
+    }
 
     std::vector<glm::vec3> corners = {
         glm::vec3(gridMin, gridMin, gridMin),
@@ -528,63 +2249,181 @@ int main(int argc, char **argv)
     GLuint axesVAO = createLineVAO(axesVertices);
     GLsizei axesVertexCount = axesVertices.size() / 3;
 
+    // Everything but the camera is fixed for the lifetime of the window, so set
+    // it once and keep the locations that still change per draw.
+    GLuint frameUBO = createFrameUniformBuffer({shaderProgram, lineShaderProgram});
+    glUseProgram(shaderProgram);
+    glUniform3f(glGetUniformLocation(shaderProgram, "LightDir"), 10.0f, 10.0f, 10.0f);
+    glUniform3f(glGetUniformLocation(shaderProgram, "modelColor"), 0.0f, 0.8f, 0.8f);
+    if (!sculpt && !playback && !floatVBO)
+    {
+        glUniform3f(glGetUniformLocation(shaderProgram, "positionOffset"), packedMesh.boxMin, packedMesh.boxMin, packedMesh.boxMin);
+        glUniform1f(glGetUniformLocation(shaderProgram, "positionScale"), packedMesh.boxMax - packedMesh.boxMin);
+        glUniform1i(glGetUniformLocation(shaderProgram, "octNormals"), GL_TRUE);
+    }
+    else
+    {
+        glUniform3f(glGetUniformLocation(shaderProgram, "positionOffset"), 0.0f, 0.0f, 0.0f);
+        glUniform1f(glGetUniformLocation(shaderProgram, "positionScale"), 1.0f);
+        glUniform1i(glGetUniformLocation(shaderProgram, "octNormals"), GL_FALSE);
+    }
+    GLint lineColorLocation = glGetUniformLocation(lineShaderProgram, "lineColor");
+    glm::vec3 axisColors[3] = {glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f)};
+
+    // Redraws only when input, a resize or new mesh data asks for it and
+    // otherwise sleeps in glfwWaitEvents. Playback wakes up once per frame.
+#ifdef MC_PROFILE
+    double frameMs = 0.0;
+#endif
     while (!glfwWindowShouldClose(window))
     {
+        if (!redrawNeeded && !playback && !continuous)
+        {
+            glfwWaitEvents();
+            continue;
+        }
+        redrawNeeded = false;
+
+        MC_PROFILE_SCOPE(StageFrame);
+#ifdef MC_PROFILE
+        double frameStart = glfwGetTime();
+#endif
+
         glClearColor(0.1f, 0.1f, 0.15f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+        FrameUniforms frameUniforms;
         glm::vec3 cameraPos = computeCameraPos();
-        glm::mat4 V = glm::lookAt(cameraPos, glm::vec3(0, 0, 0), glm::vec3(0, 1, 0));
-        glm::mat4 P = glm::perspective(glm::radians(45.0f), 800.0f / 600.0f, 0.1f, 100.0f);
-        glm::mat4 M = glm::mat4(1.0f);
-        glm::mat4 MVP = P * V * M;
+        frameUniforms.V = glm::lookAt(cameraPos, glm::vec3(0, 0, 0), glm::vec3(0, 1, 0));
+        frameUniforms.MVP = projection * frameUniforms.V;
+        frameUniforms.cameraPos = glm::vec4(cameraPos, 1.0f);
+        glBindBuffer(GL_UNIFORM_BUFFER, frameUBO);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &frameUniforms);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
 
         glUseProgram(shaderProgram);
+        if (sculpt)
+        {
+            if (brushPressed)
+            {
+                double xpos, ypos;
+                glm::vec3 hit;
+                glfwGetCursorPos(window, &xpos, &ypos);
+                if (pickSurface(window, sculptMesh, xpos, ypos, hit) && brushStampDue(strokeStamped, lastStamp, hit, cameraPos))
+                {
+                    applyBrush(sculptMesh, hit, brushRadius, !brushCarves);
+                    strokeStamped = true;
+                    lastStamp = hit;
+                }
+            }
+            else
+            {
+                strokeStamped = false;
+            }
+            updateDirtyChunks(sculptMesh);
+            drawChunkedMesh(sculptMesh);
+        }
+        else if (playback)
+        {
+            double now = glfwGetTime();
+            MeshFrame frame;
+            if (pipeline->acquire((int)((now - playbackStart) * playbackFps), frame))
+            {
+                uploadPlaybackFrame(playbackBuffers, frame);
+                pipeline->release(frame);
+                uploadedFrames++;
+            }
+            drawPlaybackBuffers(playbackBuffers);
+            displayedFrames++;
 
-        glUniform3fv(glGetUniformLocation(shaderProgram, "cameraPos"), 1, glm::value_ptr(cameraPos));
-
-        glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "MVP"), 1, GL_FALSE, glm::value_ptr(MVP));
-        glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "V"), 1, GL_FALSE, glm::value_ptr(V));
-        glUniform3f(glGetUniformLocation(shaderProgram, "LightDir"), 10.0f, 10.0f, 10.0f);
-
-        glUniform3f(glGetUniformLocation(shaderProgram, "modelColor"), 0.0f, 0.8f, 0.8f);
-        glBindVertexArray(meshVAO);
-        glDrawArrays(GL_TRIANGLES, 0, meshVertexCount);
-        glBindVertexArray(0);
+            if (now - statsStart >= 1.0)
+            {
+                int extracted = pipeline->extractedFrames;
+                double elapsed = now - statsStart;
+                std::string stats = "extraction " + std::to_string((int)std::lround((extracted - statsExtracted) / elapsed)) +
+                                    " fps, display " + std::to_string((int)std::lround(displayedFrames / elapsed)) +
+                                    " fps, new meshes " + std::to_string((int)std::lround(uploadedFrames / elapsed)) +
+                                    "/s, dropped " + std::to_string(pipeline->droppedFrames.load());
+                std::cout << stats << "\n";
+                glfwSetWindowTitle(window, stats.c_str());
+                statsStart = now;
+                statsExtracted = extracted;
+                displayedFrames = uploadedFrames = 0;
+            }
+        }
+        else if (!floatVBO)
+        {
+            drawPackedMesh(packedMesh);
+        }
+        else
+        {
+            glBindVertexArray(meshVAO);
+            glDrawArrays(GL_TRIANGLES, 0, meshVertexCount);
+            glBindVertexArray(0);
+        }
 
         glUseProgram(lineShaderProgram);
-        glUniformMatrix4fv(glGetUniformLocation(lineShaderProgram, "MVP"), 1, GL_FALSE, glm::value_ptr(MVP));
-        glUniform3f(glGetUniformLocation(lineShaderProgram, "lineColor"), 1.0f, 1.0f, 1.0f);
+        glUniform3f(lineColorLocation, 1.0f, 1.0f, 1.0f);
         glBindVertexArray(boxVAO);
         glDrawArrays(GL_LINES, 0, boxVertexCount);
+
+        glDisable(GL_DEPTH_TEST);
+        glBindVertexArray(axesVAO);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            glUniform3fv(lineColorLocation, 1, glm::value_ptr(axisColors[axis]));
+            glDrawArrays(GL_LINES, axis * axesVertexCount / 3, axesVertexCount / 3);
+        }
+        glEnable(GL_DEPTH_TEST);
         glBindVertexArray(0);
 
         glUseProgram(0);
 
-        glMatrixMode(GL_PROJECTION);
-        glPushMatrix();
-        glLoadMatrixf(glm::value_ptr(P));
+#ifdef MC_PROFILE
+        if (showHud)
+            drawProfilerHud(window, frameMs);
+#endif
 
-        glMatrixMode(GL_MODELVIEW);
-        glPushMatrix();
-        glLoadMatrixf(glm::value_ptr(V * M));
+        glfwSwapBuffers(window);
+#ifdef MC_PROFILE
+        frameMs = (glfwGetTime() - frameStart) * 1000.0;
+#endif
 
-        glDisable(GL_DEPTH_TEST);
-        worldaxes.draw();
-        glEnable(GL_DEPTH_TEST);
+        if (playback)
+        {
+            double elapsed = glfwGetTime() - playbackStart;
+            double untilNextFrame = (std::floor(elapsed * playbackFps) + 1.0) / playbackFps - elapsed;
+            glfwWaitEventsTimeout(std::max(untilNextFrame, 0.0));
+        }
+        else
+        {
+            glfwPollEvents();
+        }
+    }
 
-        glPopMatrix();
-        glMatrixMode(GL_PROJECTION);
-        glPopMatrix();
+    if (sculpt)
+    {
+        collectChunkedMesh(sculptMesh, meshVertices, meshNormals);
+        writePLY(meshVertices, meshNormals, outputFile);
+        glDeleteVertexArrays(1, &sculptMesh.VAO);
+        glDeleteBuffers(1, &sculptMesh.VBO);
+    }
 
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+    if (playback)
+    {
+        pipeline.reset();
+        glDeleteVertexArrays(2, playbackBuffers.VAO);
+        glDeleteBuffers(2, playbackBuffers.VBO);
     }
 
     glDeleteVertexArrays(1, &meshVAO);
     glDeleteBuffers(1, &meshVBO);
+    glDeleteVertexArrays(1, &packedMesh.VAO);
+    glDeleteBuffers(1, &packedMesh.VBO);
+    glDeleteBuffers(1, &packedMesh.EBO);
     glDeleteVertexArrays(1, &boxVAO);
     glDeleteVertexArrays(1, &axesVAO);
+    glDeleteBuffers(1, &frameUBO);
     glDeleteProgram(shaderProgram);
     glDeleteProgram(lineShaderProgram);
     glfwDestroyWindow(window);